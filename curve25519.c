@@ -47,6 +47,40 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+
+/* Where the compiler offers a 64x64->128-bit multiply (MSVC x64, or any
+ * compiler with unsigned __int128) field elements use five 51-bit limbs, as
+ * in curve25519-donna-c64. Other targets keep the ten 25.5-bit limbs below.
+ * Define CURVE25519_BENCHMARK to build both and curve25519_benchmark().
+ */
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#define CURVE25519_51BIT 1
+typedef struct { unsigned long long lo, hi; } fe51_u128;
+#define FE51_MUL(out, x, y) out.lo = _umul128((x), (y), &out.hi)
+#define FE51_MAC(out, x, y) \
+  { fe51_u128 p_; uint64_t l_ = out.lo; FE51_MUL(p_, x, y); \
+    out.lo += p_.lo; out.hi += p_.hi + (out.lo < l_); }
+#define FE51_ADD64(out, c) \
+  { uint64_t l_ = out.lo; out.lo += (c); out.hi += (out.lo < l_); }
+#define FE51_SHR51(in) __shiftright128(in.lo, in.hi, 51)
+#define FE51_LO(in) (in.lo)
+#elif defined(__SIZEOF_INT128__)
+#define CURVE25519_51BIT 1
+typedef unsigned __int128 fe51_u128;
+#define FE51_MUL(out, x, y) out = (fe51_u128)(x) * (y)
+#define FE51_MAC(out, x, y) out += (fe51_u128)(x) * (y)
+#define FE51_ADD64(out, c) out += (c)
+#define FE51_SHR51(in) (uint64_t)((in) >> 51)
+#define FE51_LO(in) (uint64_t)(in)
+#else
+#define CURVE25519_51BIT 0
+#endif
+
+static const unsigned char kCurve25519BasePoint[ 32 ] = { 9 };
+
+#if !CURVE25519_51BIT || defined(CURVE25519_BENCHMARK)
 
 /* Field element representation:
  *
@@ -666,15 +700,11 @@ static void crecip(int64_t *out, const int64_t *z) {
   /* 2^255 - 21 */ fmul(out,t1,z11);
 }
 
-static const unsigned char kCurve25519BasePoint[ 32 ] = { 9 };
-
-void curve25519(uint8_t *mypublic, const uint8_t *secret, const uint8_t *basepoint) {
+static void curve25519_donna(uint8_t *mypublic, const uint8_t *secret, const uint8_t *basepoint) {
   int64_t bp[10], x[10], z[11], zmone[10];
   uint8_t e[32];
   int i;
 
-  if (basepoint == 0) basepoint = kCurve25519BasePoint;
-
   for (i = 0; i < 32; ++i) e[i] = secret[i];
   e[0] &= 248;
   e[31] &= 127;
@@ -687,3 +717,364 @@ void curve25519(uint8_t *mypublic, const uint8_t *secret, const uint8_t *basepoi
   freduce_coefficients(z);
   fcontract(mypublic, z);
 }
+
+#endif /* !CURVE25519_51BIT || CURVE25519_BENCHMARK */
+
+#if CURVE25519_51BIT
+
+/* Field elements are five unsigned 51-bit limbs, least significant first:
+ *   x[0] + 2^51*x[1] + 2^102*x[2] + 2^153*x[3] + 2^204*x[4]
+ * Limbs may grow a few bits past 51 between reductions; every product is
+ * carried back to at most 52 bits per limb.
+ */
+typedef uint64_t fe51[5];
+
+#define FE51_MASK 0x7ffffffffffffULL
+
+/* output += in */
+static void fe51_sum(fe51 output, const fe51 in) {
+  output[0] += in[0];
+  output[1] += in[1];
+  output[2] += in[2];
+  output[3] += in[3];
+  output[4] += in[4];
+}
+
+/* output = in - output, adding 8p first so nothing goes negative */
+static void fe51_difference_backwards(fe51 output, const fe51 in) {
+  static const uint64_t two54m152 = (((uint64_t)1) << 54) - 152;
+  static const uint64_t two54m8 = (((uint64_t)1) << 54) - 8;
+
+  output[0] = in[0] + two54m152 - output[0];
+  output[1] = in[1] + two54m8 - output[1];
+  output[2] = in[2] + two54m8 - output[2];
+  output[3] = in[3] + two54m8 - output[3];
+  output[4] = in[4] + two54m8 - output[4];
+}
+
+/* Carries the five 128-bit column sums t into output, folding the top
+ * carry back in times 19 (2^255 = 19 mod p). */
+#define FE51_CARRY(output, t) { \
+  uint64_t r0, r1, r2, r3, r4, c; \
+  r0 = FE51_LO(t[0]) & FE51_MASK; c = FE51_SHR51(t[0]); \
+  FE51_ADD64(t[1], c); r1 = FE51_LO(t[1]) & FE51_MASK; c = FE51_SHR51(t[1]); \
+  FE51_ADD64(t[2], c); r2 = FE51_LO(t[2]) & FE51_MASK; c = FE51_SHR51(t[2]); \
+  FE51_ADD64(t[3], c); r3 = FE51_LO(t[3]) & FE51_MASK; c = FE51_SHR51(t[3]); \
+  FE51_ADD64(t[4], c); r4 = FE51_LO(t[4]) & FE51_MASK; c = FE51_SHR51(t[4]); \
+  r0 += c * 19; c = r0 >> 51; r0 &= FE51_MASK; \
+  r1 += c; c = r1 >> 51; r1 &= FE51_MASK; \
+  r2 += c; \
+  output[0] = r0; output[1] = r1; output[2] = r2; output[3] = r3; output[4] = r4; }
+
+/* output = in * scalar, scalar < 2^32 */
+static void fe51_scalar_product(fe51 output, const fe51 in, const uint64_t scalar) {
+  fe51_u128 t[5];
+
+  FE51_MUL(t[0], in[0], scalar);
+  FE51_MUL(t[1], in[1], scalar);
+  FE51_MUL(t[2], in[2], scalar);
+  FE51_MUL(t[3], in[3], scalar);
+  FE51_MUL(t[4], in[4], scalar);
+  FE51_CARRY(output, t);
+}
+
+/* output = in2 * in. output may alias either input. */
+static void fe51_mul(fe51 output, const fe51 in2, const fe51 in) {
+  fe51_u128 t[5];
+  uint64_t r0, r1, r2, r3, r4, s0, s1, s2, s3, s4;
+
+  r0 = in[0]; r1 = in[1]; r2 = in[2]; r3 = in[3]; r4 = in[4];
+  s0 = in2[0]; s1 = in2[1]; s2 = in2[2]; s3 = in2[3]; s4 = in2[4];
+
+  FE51_MUL(t[0], r0, s0);
+  FE51_MUL(t[1], r0, s1); FE51_MAC(t[1], r1, s0);
+  FE51_MUL(t[2], r0, s2); FE51_MAC(t[2], r2, s0); FE51_MAC(t[2], r1, s1);
+  FE51_MUL(t[3], r0, s3); FE51_MAC(t[3], r3, s0); FE51_MAC(t[3], r1, s2); FE51_MAC(t[3], r2, s1);
+  FE51_MUL(t[4], r0, s4); FE51_MAC(t[4], r4, s0); FE51_MAC(t[4], r3, s1); FE51_MAC(t[4], r1, s3);
+  FE51_MAC(t[4], r2, s2);
+
+  r4 *= 19; r1 *= 19; r2 *= 19; r3 *= 19;
+
+  FE51_MAC(t[0], r4, s1); FE51_MAC(t[0], r1, s4); FE51_MAC(t[0], r2, s3); FE51_MAC(t[0], r3, s2);
+  FE51_MAC(t[1], r4, s2); FE51_MAC(t[1], r2, s4); FE51_MAC(t[1], r3, s3);
+  FE51_MAC(t[2], r4, s3); FE51_MAC(t[2], r3, s4);
+  FE51_MAC(t[3], r4, s4);
+
+  FE51_CARRY(output, t);
+}
+
+/* output = in^(2^count), count >= 1. output may alias in. */
+static void fe51_square_times(fe51 output, const fe51 in, int count) {
+  fe51_u128 t[5];
+  uint64_t r0, r1, r2, r3, r4, d0, d1, d2, d4, d419;
+
+  r0 = in[0]; r1 = in[1]; r2 = in[2]; r3 = in[3]; r4 = in[4];
+  do {
+    d0 = r0 * 2;
+    d1 = r1 * 2;
+    d2 = r2 * 2 * 19;
+    d419 = r4 * 19;
+    d4 = d419 * 2;
+
+    FE51_MUL(t[0], r0, r0); FE51_MAC(t[0], d4, r1); FE51_MAC(t[0], d2, r3);
+    FE51_MUL(t[1], d0, r1); FE51_MAC(t[1], d4, r2); FE51_MAC(t[1], r3, r3 * 19);
+    FE51_MUL(t[2], d0, r2); FE51_MAC(t[2], r1, r1); FE51_MAC(t[2], d4, r3);
+    FE51_MUL(t[3], d0, r3); FE51_MAC(t[3], d1, r2); FE51_MAC(t[3], r4, d419);
+    FE51_MUL(t[4], d0, r4); FE51_MAC(t[4], d1, r3); FE51_MAC(t[4], r2, r2);
+
+    FE51_CARRY(output, t);
+    r0 = output[0]; r1 = output[1]; r2 = output[2]; r3 = output[3]; r4 = output[4];
+  } while (--count);
+}
+
+static uint64_t fe51_load(const uint8_t *in) {
+  return ((uint64_t)in[0]) | ((uint64_t)in[1] << 8) | ((uint64_t)in[2] << 16) | ((uint64_t)in[3] << 24) |
+         ((uint64_t)in[4] << 32) | ((uint64_t)in[5] << 40) | ((uint64_t)in[6] << 48) | ((uint64_t)in[7] << 56);
+}
+
+static void fe51_store(uint8_t *out, uint64_t in) {
+  int i;
+  for (i = 0; i < 8; ++i, in >>= 8) out[i] = (uint8_t)in;
+}
+
+/* Take a little-endian, 32-byte number and expand it into limbs; bit 255 is ignored */
+static void fe51_expand(fe51 output, const uint8_t *in) {
+  output[0] = fe51_load(in) & FE51_MASK;
+  output[1] = (fe51_load(in + 6) >> 3) & FE51_MASK;
+  output[2] = (fe51_load(in + 12) >> 6) & FE51_MASK;
+  output[3] = (fe51_load(in + 19) >> 1) & FE51_MASK;
+  output[4] = (fe51_load(in + 24) >> 12) & FE51_MASK;
+}
+
+/* Take a carried field element and write it fully reduced, little-endian */
+static void fe51_contract(uint8_t *output, const fe51 input) {
+  uint64_t t[5];
+  int i;
+
+  for (i = 0; i < 5; ++i) t[i] = input[i];
+
+  for (i = 0; i < 2; ++i) {
+    t[1] += t[0] >> 51; t[0] &= FE51_MASK;
+    t[2] += t[1] >> 51; t[1] &= FE51_MASK;
+    t[3] += t[2] >> 51; t[2] &= FE51_MASK;
+    t[4] += t[3] >> 51; t[3] &= FE51_MASK;
+    t[0] += 19 * (t[4] >> 51); t[4] &= FE51_MASK;
+  }
+
+  /* now t is between 0 and 2^255-1, properly carried. Adding 19 and
+   * carrying tells the two cases below p and at or above p apart. */
+  t[0] += 19;
+  t[1] += t[0] >> 51; t[0] &= FE51_MASK;
+  t[2] += t[1] >> 51; t[1] &= FE51_MASK;
+  t[3] += t[2] >> 51; t[2] &= FE51_MASK;
+  t[4] += t[3] >> 51; t[3] &= FE51_MASK;
+  t[0] += 19 * (t[4] >> 51); t[4] &= FE51_MASK;
+
+  /* now between 19 and 2^255-1 in both cases, offset by 19; add 2^255 - 19 */
+  t[0] += 0x8000000000000ULL - 19;
+  t[1] += 0x8000000000000ULL - 1;
+  t[2] += 0x8000000000000ULL - 1;
+  t[3] += 0x8000000000000ULL - 1;
+  t[4] += 0x8000000000000ULL - 1;
+
+  /* now between 2^255 and 2^256-20, offset by 2^255 */
+  t[1] += t[0] >> 51; t[0] &= FE51_MASK;
+  t[2] += t[1] >> 51; t[1] &= FE51_MASK;
+  t[3] += t[2] >> 51; t[2] &= FE51_MASK;
+  t[4] += t[3] >> 51; t[3] &= FE51_MASK;
+  t[4] &= FE51_MASK;
+
+  fe51_store(output, t[0] | (t[1] << 51));
+  fe51_store(output + 8, (t[1] >> 13) | (t[2] << 38));
+  fe51_store(output + 16, (t[2] >> 26) | (t[3] << 25));
+  fe51_store(output + 24, (t[3] >> 39) | (t[4] << 12));
+}
+
+/* Same ladder step as fmonty above on 51-bit limbs. x, z, xprime and
+ * zprime are destroyed. */
+static void fe51_monty(fe51 x2, fe51 z2,  /* output 2Q */
+                       fe51 x3, fe51 z3,  /* output Q + Q' */
+                       fe51 x, fe51 z,    /* input Q */
+                       fe51 xprime, fe51 zprime,  /* input Q' */
+                       const fe51 qmqp /* input Q - Q' */) {
+  fe51 origx, origxprime, zzz, xx, zz, xxprime, zzprime, zzzprime;
+
+  memcpy(origx, x, sizeof(fe51));
+  fe51_sum(x, z);
+  fe51_difference_backwards(z, origx);  // does x - z
+
+  memcpy(origxprime, xprime, sizeof(fe51));
+  fe51_sum(xprime, zprime);
+  fe51_difference_backwards(zprime, origxprime);
+  fe51_mul(xxprime, xprime, z);
+  fe51_mul(zzprime, x, zprime);
+  memcpy(origxprime, xxprime, sizeof(fe51));
+  fe51_sum(xxprime, zzprime);
+  fe51_difference_backwards(zzprime, origxprime);
+  fe51_square_times(x3, xxprime, 1);
+  fe51_square_times(zzzprime, zzprime, 1);
+  fe51_mul(z3, zzzprime, qmqp);
+
+  fe51_square_times(xx, x, 1);
+  fe51_square_times(zz, z, 1);
+  fe51_mul(x2, xx, zz);
+  fe51_difference_backwards(zz, xx);  // does zz = xx - zz
+  fe51_scalar_product(zzz, zz, 121665);
+  fe51_sum(zzz, xx);
+  fe51_mul(z2, zz, zzz);
+}
+
+/* Swaps a and b when iswap is 1, in data-invariant time. iswap must be 0 or 1. */
+static void fe51_swap_conditional(fe51 a, fe51 b, uint64_t iswap) {
+  const uint64_t swap = 0 - iswap;
+  unsigned i;
+
+  for (i = 0; i < 5; ++i) {
+    const uint64_t x = swap & (a[i] ^ b[i]);
+    a[i] ^= x;
+    b[i] ^= x;
+  }
+}
+
+static void fe51_cmult(fe51 resultx, fe51 resultz, const uint8_t *n, const fe51 q) {
+  fe51 a = {0}, b = {1}, c = {1}, d = {0};
+  uint64_t *nqpqx = a, *nqpqz = b, *nqx = c, *nqz = d, *t;
+  fe51 e = {0}, f = {1}, g = {0}, h = {1};
+  uint64_t *nqpqx2 = e, *nqpqz2 = f, *nqx2 = g, *nqz2 = h;
+  unsigned i, j;
+
+  memcpy(nqpqx, q, sizeof(fe51));
+
+  for (i = 0; i < 32; ++i) {
+    uint8_t byte = n[31 - i];
+    for (j = 0; j < 8; ++j) {
+      const uint64_t bit = byte >> 7;
+
+      fe51_swap_conditional(nqx, nqpqx, bit);
+      fe51_swap_conditional(nqz, nqpqz, bit);
+      fe51_monty(nqx2, nqz2, nqpqx2, nqpqz2, nqx, nqz, nqpqx, nqpqz, q);
+      fe51_swap_conditional(nqx2, nqpqx2, bit);
+      fe51_swap_conditional(nqz2, nqpqz2, bit);
+
+      t = nqx; nqx = nqx2; nqx2 = t;
+      t = nqz; nqz = nqz2; nqz2 = t;
+      t = nqpqx; nqpqx = nqpqx2; nqpqx2 = t;
+      t = nqpqz; nqpqz = nqpqz2; nqpqz2 = t;
+
+      byte <<= 1;
+    }
+  }
+
+  memcpy(resultx, nqx, sizeof(fe51));
+  memcpy(resultz, nqz, sizeof(fe51));
+}
+
+/* out = z^(p-2) = 1/z, same addition chain as crecip */
+static void fe51_recip(fe51 out, const fe51 z) {
+  fe51 a, t0, b, c;
+
+  /* 2 */ fe51_square_times(a, z, 1);
+  /* 8 */ fe51_square_times(t0, a, 2);
+  /* 9 */ fe51_mul(b, t0, z);
+  /* 11 */ fe51_mul(a, b, a);
+  /* 22 */ fe51_square_times(t0, a, 1);
+  /* 2^5 - 2^0 = 31 */ fe51_mul(b, t0, b);
+  /* 2^10 - 2^5 */ fe51_square_times(t0, b, 5);
+  /* 2^10 - 2^0 */ fe51_mul(b, t0, b);
+  /* 2^20 - 2^10 */ fe51_square_times(t0, b, 10);
+  /* 2^20 - 2^0 */ fe51_mul(c, t0, b);
+  /* 2^40 - 2^20 */ fe51_square_times(t0, c, 20);
+  /* 2^40 - 2^0 */ fe51_mul(t0, t0, c);
+  /* 2^50 - 2^10 */ fe51_square_times(t0, t0, 10);
+  /* 2^50 - 2^0 */ fe51_mul(b, t0, b);
+  /* 2^100 - 2^50 */ fe51_square_times(t0, b, 50);
+  /* 2^100 - 2^0 */ fe51_mul(c, t0, b);
+  /* 2^200 - 2^100 */ fe51_square_times(t0, c, 100);
+  /* 2^200 - 2^0 */ fe51_mul(t0, t0, c);
+  /* 2^250 - 2^50 */ fe51_square_times(t0, t0, 50);
+  /* 2^250 - 2^0 */ fe51_mul(t0, t0, b);
+  /* 2^255 - 2^5 */ fe51_square_times(t0, t0, 5);
+  /* 2^255 - 21 */ fe51_mul(out, t0, a);
+}
+
+static void curve25519_51(uint8_t *mypublic, const uint8_t *secret, const uint8_t *basepoint) {
+  fe51 bp, x, z, zmone;
+  uint8_t e[32];
+  int i;
+
+  for (i = 0; i < 32; ++i) e[i] = secret[i];
+  e[0] &= 248;
+  e[31] &= 127;
+  e[31] |= 64;
+
+  fe51_expand(bp, basepoint);
+  fe51_cmult(x, z, e, bp);
+  fe51_recip(zmone, z);
+  fe51_mul(z, x, zmone);
+  fe51_contract(mypublic, z);
+}
+
+#endif /* CURVE25519_51BIT */
+
+void curve25519(uint8_t *mypublic, const uint8_t *secret, const uint8_t *basepoint) {
+  if (basepoint == 0) basepoint = kCurve25519BasePoint;
+
+#if CURVE25519_51BIT
+  curve25519_51(mypublic, secret, basepoint);
+#else
+  curve25519_donna(mypublic, secret, basepoint);
+#endif
+}
+
+#ifdef CURVE25519_BENCHMARK
+#include <stdio.h>
+#include <time.h>
+/*
+ * Cost of one X25519 handshake (key generation plus shared secret, i.e. two
+ * scalar multiplications) with the 10-limb code and, where available, the
+ * 51-bit code. Both are checked against each other first. Build a test
+ * program with CURVE25519_BENCHMARK defined and call curve25519_benchmark().
+ */
+static void curve25519_benchmark(void) {
+  static void (*const impls[])(uint8_t *, const uint8_t *, const uint8_t *) = {
+    curve25519_donna,
+#if CURVE25519_51BIT
+    curve25519_51,
+#endif
+  };
+  static const char *names[] = {"donna 10x25.5", "donna 5x51"};
+  uint8_t priv[32], peer[32], pub[32], secret[32], ref[32], key[32];
+  unsigned n;
+  int i;
+
+  for (i = 0; i < 32; ++i) {
+    priv[i] = (uint8_t)(i * 29 + 3);
+    peer[i] = (uint8_t)(i * 71 + 11);
+  }
+  peer[31] &= 127;
+  curve25519_donna(ref, priv, peer);
+  for (n = 0; n < sizeof(impls) / sizeof(impls[0]); ++n) {
+    clock_t start, elapsed;
+    unsigned count = 0;
+
+    impls[n](secret, priv, peer);
+    if (memcmp(secret, ref, 32)) {
+      printf("x25519 %-14s: MISMATCH\n", names[n]);
+      continue;
+    }
+    memcpy(key, priv, 32);
+    start = clock();
+    do {
+      for (i = 0; i < 64; ++i) {
+        impls[n](pub, key, kCurve25519BasePoint);
+        impls[n](secret, key, peer);
+        key[0] ^= secret[0];
+      }
+      count += 64;
+      elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC / 2);
+    printf("x25519 %-14s: %7.1f us per keygen + shared secret\n", names[n],
+           (double)elapsed * 1e6 / CLOCKS_PER_SEC / count);
+  }
+}
+#endif /* CURVE25519_BENCHMARK */
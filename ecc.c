@@ -79,6 +79,28 @@ struct EccState
 	EccPoint publickey;
 };
 
+/* Fixed-width stand-in for EccState. The field and point helpers below take
+   the state as a template parameter; with EccFixed the curve size and digit
+   count are compile-time constants, so the curve dispatch in
+   vli_modMult_fast() folds away and the per-digit loops can be unrolled.
+   ecdh_shared_secret() and ecc_init() use it for P-256 and P-384. */
+template<uint32_t BYTES>
+struct EccFixed
+{
+	static const uint32_t ECC_BYTES = BYTES;
+	static const uint32_t NUM_ECC_DIGITS = BYTES/8;
+	uint64_t curve_p[MAX_NUM_ECC_DIGITS];
+	uint64_t curve_b[MAX_NUM_ECC_DIGITS];
+
+	EccFixed(const EccState *s)
+	{
+		memcpy(curve_p, s->curve_p, sizeof(curve_p));
+		memcpy(curve_b, s->curve_b, sizeof(curve_b));
+	}
+};
+template<uint32_t BYTES> const uint32_t EccFixed<BYTES>::ECC_BYTES;
+template<uint32_t BYTES> const uint32_t EccFixed<BYTES>::NUM_ECC_DIGITS;
+
 
 
 
@@ -90,7 +112,7 @@ struct EccState
 #include <windows.h>
 #include <wincrypt.h>
 
-static int getRandomNumber(EccState *s, uint64_t *p_vli)
+static int getRandomBytes(void *p_dest, uint32_t p_size)
 {
     HCRYPTPROV l_prov;
     if(!CryptAcquireContext(&l_prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
@@ -98,7 +120,7 @@ static int getRandomNumber(EccState *s, uint64_t *p_vli)
         return 0;
     }
 
-    CryptGenRandom(l_prov, s->ECC_BYTES, (BYTE *)p_vli);
+    CryptGenRandom(l_prov, p_size, (BYTE *)p_dest);
     CryptReleaseContext(l_prov, 0);
     
     return 1;
@@ -115,7 +137,7 @@ static int getRandomNumber(EccState *s, uint64_t *p_vli)
     #define O_CLOEXEC 0
 #endif
 
-static int getRandomNumber(uint64_t *p_vli)
+static int getRandomBytes(void *p_dest, uint32_t p_size)
 {
     int l_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
     if(l_fd == -1)
@@ -127,8 +149,8 @@ static int getRandomNumber(uint64_t *p_vli)
         }
     }
     
-    char *l_ptr = (char *)p_vli;
-    size_t l_left = ECC_BYTES;
+    char *l_ptr = (char *)p_dest;
+    size_t l_left = p_size;
     while(l_left > 0)
     {
         int l_read = read(l_fd, l_ptr, l_left);
@@ -147,7 +169,13 @@ static int getRandomNumber(uint64_t *p_vli)
 
 #endif /* _WIN32 */
 
-static void vli_clear(EccState *s, uint64_t *p_vli)
+static int getRandomNumber(EccState *s, uint64_t *p_vli)
+{
+    return getRandomBytes(p_vli, s->ECC_BYTES);
+}
+
+template<class S>
+static void vli_clear(S *s, uint64_t *p_vli)
 {
     uint i;
     for(i=0; i< s->NUM_ECC_DIGITS; ++i)
@@ -157,7 +185,8 @@ static void vli_clear(EccState *s, uint64_t *p_vli)
 }
 
 /* Returns 1 if p_vli == 0, 0 otherwise. */
-static int vli_isZero(EccState *s, uint64_t *p_vli)
+template<class S>
+static int vli_isZero(S *s, uint64_t *p_vli)
 {
     uint i;
     for(i = 0; i < s->NUM_ECC_DIGITS; ++i)
@@ -177,7 +206,8 @@ static uint64_t vli_testBit(uint64_t *p_vli, uint p_bit)
 }
 
 /* Counts the number of 64-bit "digits" in p_vli. */
-static uint vli_numDigits(EccState *s, uint64_t *p_vli)
+template<class S>
+static uint vli_numDigits(S *s, uint64_t *p_vli)
 {
     int i;
     /* Search from the end until we find a non-zero digit.
@@ -190,7 +220,8 @@ static uint vli_numDigits(EccState *s, uint64_t *p_vli)
 }
 
 /* Counts the number of bits required for p_vli. */
-static uint vli_numBits(EccState *s, uint64_t *p_vli)
+template<class S>
+static uint vli_numBits(S *s, uint64_t *p_vli)
 {
     uint i;
     uint64_t l_digit;
@@ -211,7 +242,8 @@ static uint vli_numBits(EccState *s, uint64_t *p_vli)
 }
 
 /* Sets p_dest = p_src. */
-static void vli_set(EccState *s, uint64_t *p_dest, uint64_t *p_src)
+template<class S>
+static void vli_set(S *s, uint64_t *p_dest, uint64_t *p_src)
 {
     uint i;
     for(i=0; i<s->NUM_ECC_DIGITS; ++i)
@@ -220,8 +252,20 @@ static void vli_set(EccState *s, uint64_t *p_dest, uint64_t *p_src)
     }
 }
 
+/* p_dest = p_mask ? p_src : p_dest, p_mask is 0 or all ones */
+template<class S>
+static void vli_select(S *s, uint64_t *p_dest, uint64_t *p_src, uint64_t p_mask)
+{
+    uint i;
+    for(i = 0; i < s->NUM_ECC_DIGITS; ++i)
+    {
+        p_dest[i] = (p_dest[i] & ~p_mask) | (p_src[i] & p_mask);
+    }
+}
+
 /* Returns sign of p_left - p_right. */
-static int vli_cmp(EccState *s, uint64_t *p_left, uint64_t *p_right)
+template<class S>
+static int vli_cmp(S *s, uint64_t *p_left, uint64_t *p_right)
 {
     int i;
     for(i = s->NUM_ECC_DIGITS-1; i >= 0; --i)
@@ -239,7 +283,8 @@ static int vli_cmp(EccState *s, uint64_t *p_left, uint64_t *p_right)
 }
 
 /* Computes p_result = p_in << c, returning carry. Can modify in place (if p_result == p_in). 0 < p_shift < 64. */
-static uint64_t vli_lshift(EccState *s, uint64_t *p_result, uint64_t *p_in, uint p_shift)
+template<class S>
+static uint64_t vli_lshift(S *s, uint64_t *p_result, uint64_t *p_in, uint p_shift)
 {
     uint64_t l_carry = 0;
     uint i;
@@ -254,7 +299,8 @@ static uint64_t vli_lshift(EccState *s, uint64_t *p_result, uint64_t *p_in, uint
 }
 
 /* Computes p_vli = p_vli >> 1. */
-static void vli_rshift1(EccState *s, uint64_t *p_vli)
+template<class S>
+static void vli_rshift1(S *s, uint64_t *p_vli)
 {
     uint64_t *l_end = p_vli;
     uint64_t l_carry = 0;
@@ -269,35 +315,35 @@ static void vli_rshift1(EccState *s, uint64_t *p_vli)
 }
 
 /* Computes p_result = p_left + p_right, returning carry. Can modify in place. */
-static uint64_t vli_add(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
+template<class S>
+static uint64_t vli_add(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
 {
     uint64_t l_carry = 0;
     uint i;
     for(i=0; i<s->NUM_ECC_DIGITS; ++i)
     {
-        uint64_t l_sum = p_left[i] + p_right[i] + l_carry;
-        if(l_sum != p_left[i])
-        {
-            l_carry = (l_sum < p_left[i]);
-        }
+        uint64_t l_sum = p_left[i] + l_carry;
+        l_carry = (l_sum < l_carry);
+        l_sum += p_right[i];
+        l_carry |= (l_sum < p_right[i]);
         p_result[i] = l_sum;
     }
     return l_carry;
 }
 
 /* Computes p_result = p_left - p_right, returning borrow. Can modify in place. */
-static uint64_t vli_sub(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
+template<class S>
+static uint64_t vli_sub(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
 {
     uint64_t l_borrow = 0;
     uint i;
     for(i=0; i<s->NUM_ECC_DIGITS; ++i)
     {
-        uint64_t l_diff = p_left[i] - p_right[i] - l_borrow;
-        if(l_diff != p_left[i])
-        {
-            l_borrow = (l_diff > p_left[i]);
-        }
-        p_result[i] = l_diff;
+        uint64_t l_diff = p_left[i] - p_right[i];
+        uint64_t l_next = (l_diff > p_left[i]);
+        l_next |= (l_diff < l_borrow);
+        p_result[i] = l_diff - l_borrow;
+        l_borrow = l_next;
     }
     return l_borrow;
 }
@@ -361,6 +407,18 @@ static void vli_square(uint64_t *p_result, uint64_t *p_left)
 
 #else /* #if SUPPORTS_INT128 */
 
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+
+static uint128_t mul_64_64(uint64_t p_left, uint64_t p_right)
+{
+    uint128_t l_result;
+    l_result.m_low = _umul128(p_left, p_right, &l_result.m_high);
+    return l_result;
+}
+
+#else
+
 static uint128_t mul_64_64(uint64_t p_left, uint64_t p_right)
 {
     uint128_t l_result;
@@ -388,6 +446,8 @@ static uint128_t mul_64_64(uint64_t p_left, uint64_t p_right)
     return l_result;
 }
 
+#endif /* _M_X64 */
+
 static uint128_t add_128_128(uint128_t a, uint128_t b)
 {
     uint128_t l_result;
@@ -396,7 +456,15 @@ static uint128_t add_128_128(uint128_t a, uint128_t b)
     return l_result;
 }
 
-static void vli_mult(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
+/* Returns the carry out of l_sum = a + b. Comparing only the high halves
+   misses it when a.m_high is all ones and the low halves carry. */
+static uint64_t add_128_carry(uint128_t l_sum, uint128_t b)
+{
+    return (l_sum.m_high < b.m_high) | ((l_sum.m_high == b.m_high) & (l_sum.m_low < b.m_low));
+}
+
+template<class S>
+static void vli_mult(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
 {
     uint128_t r01 = {0, 0};
     uint64_t r2 = 0;
@@ -411,7 +479,7 @@ static void vli_mult(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t
         {
             uint128_t l_product = mul_64_64(p_left[i], p_right[k-i]);
             r01 = add_128_128(r01, l_product);
-            r2 += (r01.m_high < l_product.m_high);
+            r2 += add_128_carry(r01, l_product);
         }
         p_result[k] = r01.m_low;
         r01.m_low = r01.m_high;
@@ -422,7 +490,8 @@ static void vli_mult(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t
     p_result[s->NUM_ECC_DIGITS*2 - 1] = r01.m_low;
 }
 
-static void vli_square(EccState *s, uint64_t *p_result, uint64_t *p_left)
+template<class S>
+static void vli_square(S *s, uint64_t *p_result, uint64_t *p_left)
 {
     uint128_t r01 = {0, 0};
     uint64_t r2 = 0;
@@ -441,7 +510,7 @@ static void vli_square(EccState *s, uint64_t *p_result, uint64_t *p_left)
                 l_product.m_low <<= 1;
             }
             r01 = add_128_128(r01, l_product);
-            r2 += (r01.m_high < l_product.m_high);
+            r2 += add_128_carry(r01, l_product);
         }
         p_result[k] = r01.m_low;
         r01.m_low = r01.m_high;
@@ -452,36 +521,93 @@ static void vli_square(EccState *s, uint64_t *p_result, uint64_t *p_left)
     p_result[s->NUM_ECC_DIGITS*2 - 1] = r01.m_low;
 }
 
+/* Squaring for EccFixed without vli_square's branch on every term: the
+   cross products a[i]*a[j], i < j, are summed once, doubled with a shift,
+   and the squares a[i]^2 added on the diagonal. */
+template<uint32_t BYTES>
+static void vli_square(EccFixed<BYTES> *s, uint64_t *p_result, uint64_t *p_left)
+{
+    const uint N = s->NUM_ECC_DIGITS;
+    uint128_t r01 = {0, 0};
+    uint64_t r2 = 0, l_carry = 0;
+    uint i, k;
+
+    p_result[0] = 0;
+    for(k = 1; k < N*2 - 2; ++k)
+    {
+        for(i = (k < N ? 0 : (k + 1) - N); i < k - i; ++i)
+        {
+            uint128_t l_product = mul_64_64(p_left[i], p_left[k-i]);
+            r01 = add_128_128(r01, l_product);
+            r2 += add_128_carry(r01, l_product);
+        }
+        p_result[k] = r01.m_low;
+        r01.m_low = r01.m_high;
+        r01.m_high = r2;
+        r2 = 0;
+    }
+    p_result[N*2 - 2] = r01.m_low;
+    p_result[N*2 - 1] = 0;
+
+    for(k = N*2 - 1; k > 0; --k)
+    {
+        p_result[k] = (p_result[k] << 1) | (p_result[k-1] >> 63);
+    }
+    p_result[0] = 0;
+
+    for(i = 0; i < N; ++i)
+    {
+        uint128_t l_square = mul_64_64(p_left[i], p_left[i]);
+        uint64_t l_sum = p_result[2*i] + l_carry;
+        l_carry = (l_sum < l_carry);
+        l_sum += l_square.m_low;
+        l_carry += (l_sum < l_square.m_low);
+        p_result[2*i] = l_sum;
+
+        l_sum = p_result[2*i + 1] + l_carry;
+        l_carry = (l_sum < l_carry);
+        l_sum += l_square.m_high;
+        l_carry += (l_sum < l_square.m_high);
+        p_result[2*i + 1] = l_sum;
+    }
+}
+
 #endif /* SUPPORTS_INT128 */
 
 
 /* Computes p_result = (p_left + p_right) % p_mod.
-   Assumes that p_left < p_mod and p_right < p_mod, p_result != p_mod. */
-static void vli_modAdd(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right, uint64_t *p_mod)
+   Assumes that p_left < p_mod and p_right < p_mod, p_result != p_mod.
+   Both the sum and the sum minus p_mod are computed and one is kept with a
+   mask, so there is no branch on the operands. */
+template<class S>
+static void vli_modAdd(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right, uint64_t *p_mod)
 {
+    uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
     uint64_t l_carry = vli_add(s, p_result, p_left, p_right);
-    if(l_carry || vli_cmp(s, p_result, p_mod) >= 0)
-    { /* p_result > p_mod (p_result = p_mod + remainder), so subtract p_mod to get remainder. */
-        vli_sub(s, p_result, p_result, p_mod);
-    }
+    uint64_t l_borrow = vli_sub(s, l_tmp, p_result, p_mod);
+    /* The sum is >= p_mod (p_result = p_mod + remainder) when it carried out
+       or p_result - p_mod did not borrow; then keep the remainder. */
+    vli_select(s, p_result, l_tmp, 0 - (l_carry | (l_borrow ^ 1)));
 }
 
 /* Computes p_result = (p_left - p_right) % p_mod.
    Assumes that p_left < p_mod and p_right < p_mod, p_result != p_mod. */
-static void vli_modSub(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right, uint64_t *p_mod)
+template<class S>
+static void vli_modSub(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right, uint64_t *p_mod)
 {
+    uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
     uint64_t l_borrow = vli_sub(s, p_result, p_left, p_right);
-    if(l_borrow)
-    { /* In this case, p_result == -diff == (max int) - diff.
-         Since -x % d == d - x, we can get the correct result from p_result + p_mod (with overflow). */
-        vli_add(s, p_result, p_result, p_mod);
-    }
+    /* On a borrow p_result == -diff == (max int) - diff.
+       Since -x % d == d - x, we can get the correct result from p_result + p_mod (with overflow). */
+    vli_add(s, l_tmp, p_result, p_mod);
+    vli_select(s, p_result, l_tmp, 0 - l_borrow);
 }
 
 
 /* Computes p_result = p_product % curve_p.
    See algorithm 5 and 6 from http://www.isys.uni-klu.ac.at/PDF/2001-0126-MT.pdf */
-static void vli_mmod_fast128(EccState *s, uint64_t *p_result, uint64_t *p_product)
+template<class S>
+static void vli_mmod_fast128(S *s, uint64_t *p_result, uint64_t *p_product)
 {
     uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
     int64_t l_carry;
@@ -521,7 +647,8 @@ static void vli_mmod_fast128(EccState *s, uint64_t *p_result, uint64_t *p_produc
 
 /* Computes p_result = p_product % curve_p.
    See algorithm 5 and 6 from http://www.isys.uni-klu.ac.at/PDF/2001-0126-MT.pdf */
-static void vli_mmod_fast192(EccState *s, uint64_t *p_result, uint64_t *p_product)
+template<class S>
+static void vli_mmod_fast192(S *s, uint64_t *p_result, uint64_t *p_product)
 {
     uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
     int64_t l_carry;
@@ -549,7 +676,8 @@ static void vli_mmod_fast192(EccState *s, uint64_t *p_result, uint64_t *p_produc
 
 /* Computes p_result = p_product % curve_p
    from http://www.nsa.gov/ia/_files/nist-routines.pdf */
-static void vli_mmod_fast256(EccState *s, uint64_t *p_result, uint64_t *p_product)
+template<class S>
+static void vli_mmod_fast256(S *s, uint64_t *p_result, uint64_t *p_product)
 {
     uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
     int64_t l_carry;
@@ -631,7 +759,8 @@ static void vli_mmod_fast256(EccState *s, uint64_t *p_result, uint64_t *p_produc
 }
 
 
-static void omega_mult384(EccState *s, uint64_t *p_result, uint64_t *p_right)
+template<class S>
+static void omega_mult384(S *s, uint64_t *p_result, uint64_t *p_right)
 {
     uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
     uint64_t l_carry, l_diff;
@@ -661,7 +790,8 @@ static void omega_mult384(EccState *s, uint64_t *p_result, uint64_t *p_right)
 /* Computes p_result = p_product % curve_p
     see PDF "Comparing Elliptic Curve Cryptography and RSA on 8-bit CPUs"
     section "Curve-Specific Optimizations" */
-static void vli_mmod_fast384(EccState *s, uint64_t *p_result, uint64_t *p_product)
+template<class S>
+static void vli_mmod_fast384(S *s, uint64_t *p_result, uint64_t *p_product)
 {
     uint64_t l_tmp[2*MAX_NUM_ECC_DIGITS];
      
@@ -695,8 +825,118 @@ static void vli_mmod_fast384(EccState *s, uint64_t *p_result, uint64_t *p_produc
 }
 
 
+/* Fixed-width reductions for EccFixed. With the curve known at compile time
+   the product is split into 32-bit words c[0..] and each result word is a
+   single signed sum of them (FIPS 186-4 D.2.3 and D.2.4), followed by one
+   carry pass. These overloads take precedence over the generic templates
+   above whenever vli_modMult_fast() runs on EccFixed. */
+
+/* Packs the word sums w[] into p_result and returns the signed carry out of
+   the top word. w[] is left holding the packed 32-bit words. */
+static int64_t ecc_pack_words(uint64_t *p_result, int64_t *w, uint p_words)
+{
+    int64_t l_carry = 0;
+    uint i;
+    for(i = 0; i < p_words; ++i)
+    {
+        l_carry += w[i];
+        w[i] = l_carry & 0xffffffff;
+        l_carry >>= 32;
+    }
+    for(i = 0; i < p_words / 2; ++i)
+    {
+        p_result[i] = (uint64_t)w[2*i] | ((uint64_t)w[2*i + 1] << 32);
+    }
+    return l_carry;
+}
+
+/* Brings p_result + l_carry * 2^(64*NUM_ECC_DIGITS) into [0, curve_p) when
+   that value lies in [-curve_p, 2*curve_p): one addition and one
+   subtraction of curve_p, each kept or dropped with a mask, so there is no
+   branch on the value. */
+template<class S>
+static void vli_mmod_finish(S *s, uint64_t *p_result, int64_t l_carry)
+{
+    uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
+    uint64_t l_mask;
+    int64_t l_next;
+
+    /* add curve_p if the value is negative */
+    l_next = l_carry + (int64_t)vli_add(s, l_tmp, p_result, s->curve_p);
+    l_mask = (uint64_t)(l_carry >> 63);
+    vli_select(s, p_result, l_tmp, l_mask);
+    l_carry = (int64_t)(((uint64_t)l_next & l_mask) | ((uint64_t)l_carry & ~l_mask));
+
+    /* subtract it if the value is still at least curve_p */
+    l_next = l_carry - (int64_t)vli_sub(s, l_tmp, p_result, s->curve_p);
+    vli_select(s, p_result, l_tmp, ~(uint64_t)(l_next >> 63));
+}
+
+static void vli_mmod_fast256(EccFixed<secp256r1> *s, uint64_t *p_result, uint64_t *p_product)
+{
+    int64_t c[16], w[8], l_carry;
+    uint i;
+
+    for(i = 0; i < 16; ++i)
+    {
+        c[i] = (uint32_t)(p_product[i / 2] >> (i % 2 * 32));
+    }
+    w[0] = c[0] + c[8] + c[9] - c[11] - c[12] - c[13] - c[14];
+    w[1] = c[1] + c[9] + c[10] - c[12] - c[13] - c[14] - c[15];
+    w[2] = c[2] + c[10] + c[11] - c[13] - c[14] - c[15];
+    w[3] = c[3] - c[8] - c[9] + 2*c[11] + 2*c[12] + c[13] - c[15];
+    w[4] = c[4] - c[9] - c[10] + 2*c[12] + 2*c[13] + c[14];
+    w[5] = c[5] - c[10] - c[11] + 2*c[13] + 2*c[14] + c[15];
+    w[6] = c[6] - c[8] - c[9] + c[13] + 3*c[14] + 2*c[15];
+    w[7] = c[7] + c[8] - c[10] - c[11] - c[12] - c[13] + 3*c[15];
+
+    /* The carry out of the word sums is in [-4, 4]. Fold it back in with
+       2^256 = 2^224 - 2^192 - 2^96 + 1 (mod p), which leaves the value in
+       (-p, 2p) for vli_mmod_finish(). */
+    l_carry = ecc_pack_words(p_result, w, 8);
+    w[0] += l_carry;
+    w[3] -= l_carry;
+    w[6] -= l_carry;
+    w[7] += l_carry;
+    vli_mmod_finish(s, p_result, ecc_pack_words(p_result, w, 8));
+}
+
+static void vli_mmod_fast384(EccFixed<secp384r1> *s, uint64_t *p_result, uint64_t *p_product)
+{
+    int64_t c[24], w[12], l_carry;
+    uint i;
+
+    for(i = 0; i < 24; ++i)
+    {
+        c[i] = (uint32_t)(p_product[i / 2] >> (i % 2 * 32));
+    }
+    w[0]  = c[0] + c[12] + c[20] + c[21] - c[23];
+    w[1]  = c[1] - c[12] + c[13] - c[20] + c[22] + c[23];
+    w[2]  = c[2] - c[13] + c[14] - c[21] + c[23];
+    w[3]  = c[3] + c[12] - c[14] + c[15] + c[20] + c[21] - c[22] - c[23];
+    w[4]  = c[4] + c[12] + c[13] - c[15] + c[16] + c[20] + 2*c[21] + c[22] - 2*c[23];
+    w[5]  = c[5] + c[13] + c[14] - c[16] + c[17] + c[21] + 2*c[22] + c[23];
+    w[6]  = c[6] + c[14] + c[15] - c[17] + c[18] + c[22] + 2*c[23];
+    w[7]  = c[7] + c[15] + c[16] - c[18] + c[19] + c[23];
+    w[8]  = c[8] + c[16] + c[17] - c[19] + c[20];
+    w[9]  = c[9] + c[17] + c[18] - c[20] + c[21];
+    w[10] = c[10] + c[18] + c[19] - c[21] + c[22];
+    w[11] = c[11] + c[19] + c[20] - c[22] + c[23];
+
+    /* The carry out of the word sums is in [-1, 3]. Fold it back in with
+       2^384 = 2^128 + 2^96 - 2^32 + 1 (mod p), which leaves the value in
+       (-p, 2p) for vli_mmod_finish(). */
+    l_carry = ecc_pack_words(p_result, w, 12);
+    w[0] += l_carry;
+    w[1] -= l_carry;
+    w[3] += l_carry;
+    w[4] += l_carry;
+    vli_mmod_finish(s, p_result, ecc_pack_words(p_result, w, 12));
+}
+
 /* Computes p_result = (p_left * p_right) % curve_p. */
-static void vli_modMult_fast(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
+template<class S>
+static void vli_modMult_fast(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right)
 {
     uint64_t l_product[2 * MAX_NUM_ECC_DIGITS];
     vli_mult(s, l_product, p_left, p_right);
@@ -711,7 +951,8 @@ static void vli_modMult_fast(EccState *s, uint64_t *p_result, uint64_t *p_left,
 }
 
 /* Computes p_result = p_left^2 % curve_p. */
-static void vli_modSquare_fast(EccState *s, uint64_t *p_result, uint64_t *p_left)
+template<class S>
+static void vli_modSquare_fast(S *s, uint64_t *p_result, uint64_t *p_left)
 {
     uint64_t l_product[2 * MAX_NUM_ECC_DIGITS];
     vli_square(s, l_product, p_left);
@@ -729,7 +970,8 @@ static void vli_modSquare_fast(EccState *s, uint64_t *p_result, uint64_t *p_left
 /* Computes p_result = (1 / p_input) % p_mod. All VLIs are the same size.
    See "From Euclid's GCD to Montgomery Multiplication to the Great Divide"
    https://labs.oracle.com/techrep/2001/smli_tr-2001-95.pdf */
-static void vli_modInv(EccState *s,uint64_t *p_result, uint64_t *p_input, uint64_t *p_mod)
+template<class S>
+static void vli_modInv(S *s,uint64_t *p_result, uint64_t *p_input, uint64_t *p_mod)
 {
     uint64_t a[MAX_NUM_ECC_DIGITS], b[MAX_NUM_ECC_DIGITS], u[MAX_NUM_ECC_DIGITS], v[MAX_NUM_ECC_DIGITS];
     uint64_t l_carry;
@@ -819,10 +1061,85 @@ static void vli_modInv(EccState *s,uint64_t *p_result, uint64_t *p_input, uint64
     vli_set(s, p_result, u);
 }
 
+/* p_result = p_left^(2^p_count) * p_right, all mod curve_p. */
+template<class S>
+static void vli_modSquareN_mult(S *s, uint64_t *p_result, uint64_t *p_left, uint p_count, uint64_t *p_right)
+{
+    uint64_t l_tmp[MAX_NUM_ECC_DIGITS];
+    uint i;
+
+    vli_modSquare_fast(s, l_tmp, p_left);
+    for(i = 1; i < p_count; ++i)
+    {
+        vli_modSquare_fast(s, l_tmp, l_tmp);
+    }
+    vli_modMult_fast(s, p_result, l_tmp, p_right);
+}
+
+/* Computes p_result = (1 / p_input) % curve_p; 0 maps to 0. */
+template<class S>
+static void vli_modInv_fast(S *s, uint64_t *p_result, uint64_t *p_input)
+{
+    vli_modInv(s, p_result, p_input, s->curve_p);
+}
+
+/* On EccFixed the inverse is p_input^(p - 2) through a fixed addition chain,
+   so neither the branches nor the memory accesses depend on the input.
+   xN below stands for p_input^(2^N - 1), a run of N one bits. */
+
+/* p - 2 = ffffffff 00000001 00000000 00000000 00000000 ffffffff ffffffff fffffffd:
+   255 squarings, 12 multiplications. */
+static void vli_modInv_fast(EccFixed<secp256r1> *s, uint64_t *p_result, uint64_t *p_input)
+{
+    uint64_t x2[MAX_NUM_ECC_DIGITS], x3[MAX_NUM_ECC_DIGITS], x6[MAX_NUM_ECC_DIGITS];
+    uint64_t x15[MAX_NUM_ECC_DIGITS], x30[MAX_NUM_ECC_DIGITS], x32[MAX_NUM_ECC_DIGITS];
+    uint64_t t[MAX_NUM_ECC_DIGITS];
+
+    vli_modSquareN_mult(s, x2, p_input, 1, p_input);
+    vli_modSquareN_mult(s, x3, x2, 1, p_input);
+    vli_modSquareN_mult(s, x6, x3, 3, x3);
+    vli_modSquareN_mult(s, t, x6, 6, x6);          /* x12 */
+    vli_modSquareN_mult(s, x15, t, 3, x3);
+    vli_modSquareN_mult(s, x30, x15, 15, x15);
+    vli_modSquareN_mult(s, x32, x30, 2, x2);
+
+    vli_modSquareN_mult(s, t, x32, 32, p_input);   /* ffffffff 00000001 */
+    vli_modSquareN_mult(s, t, t, 128, x32);        /* 00000000 x3, ffffffff */
+    vli_modSquareN_mult(s, t, t, 32, x32);         /* ffffffff */
+    vli_modSquareN_mult(s, t, t, 30, x30);         /* fffffffd: 30 ones, */
+    vli_modSquareN_mult(s, p_result, t, 2, p_input); /* then 01 */
+}
+
+/* p - 2 = ffffffff x 7, fffffffe ffffffff 00000000 00000000 fffffffd:
+   383 squarings, 15 multiplications. */
+static void vli_modInv_fast(EccFixed<secp384r1> *s, uint64_t *p_result, uint64_t *p_input)
+{
+    uint64_t x2[MAX_NUM_ECC_DIGITS], x3[MAX_NUM_ECC_DIGITS], x15[MAX_NUM_ECC_DIGITS];
+    uint64_t x30[MAX_NUM_ECC_DIGITS], x32[MAX_NUM_ECC_DIGITS], x60[MAX_NUM_ECC_DIGITS];
+    uint64_t t[MAX_NUM_ECC_DIGITS];
+
+    vli_modSquareN_mult(s, x2, p_input, 1, p_input);
+    vli_modSquareN_mult(s, x3, x2, 1, p_input);
+    vli_modSquareN_mult(s, t, x3, 3, x3);          /* x6 */
+    vli_modSquareN_mult(s, t, t, 6, t);            /* x12 */
+    vli_modSquareN_mult(s, x15, t, 3, x3);
+    vli_modSquareN_mult(s, x30, x15, 15, x15);
+    vli_modSquareN_mult(s, x32, x30, 2, x2);
+    vli_modSquareN_mult(s, x60, x30, 30, x30);
+    vli_modSquareN_mult(s, t, x60, 60, x60);       /* x120 */
+    vli_modSquareN_mult(s, t, t, 120, t);          /* x240 */
+    vli_modSquareN_mult(s, t, t, 15, x15);         /* x255 */
+
+    vli_modSquareN_mult(s, t, t, 33, x32);         /* 0, then ffffffff */
+    vli_modSquareN_mult(s, t, t, 94, x30);         /* 00000000 x2, 30 ones, */
+    vli_modSquareN_mult(s, p_result, t, 2, p_input); /* then 01 */
+}
+
 /* ------ Point operations ------ */
 
 /* Returns 1 if p_point is the point at infinity, 0 otherwise. */
-static int EccPoint_isZero(EccState *s, EccPoint *p_point)
+template<class S>
+static int EccPoint_isZero(S *s, EccPoint *p_point)
 {
     return (vli_isZero(s, p_point->x) && vli_isZero(s, p_point->y));
 }
@@ -832,7 +1149,8 @@ From http://eprint.iacr.org/2011/338.pdf
 */
 
 /* Double in place */
-static void EccPoint_double_jacobian(EccState *s,uint64_t *X1, uint64_t *Y1, uint64_t *Z1)
+template<class S>
+static void EccPoint_double_jacobian(S *s,uint64_t *X1, uint64_t *Y1, uint64_t *Z1)
 {
     /* t1 = X, t2 = Y, t3 = Z */
     uint64_t t4[MAX_NUM_ECC_DIGITS];
@@ -881,7 +1199,8 @@ static void EccPoint_double_jacobian(EccState *s,uint64_t *X1, uint64_t *Y1, uin
 }
 
 /* Modify (x1, y1) => (x1 * z^2, y1 * z^3) */
-static void apply_z(EccState *s,uint64_t *X1, uint64_t *Y1, uint64_t *Z)
+template<class S>
+static void apply_z(S *s,uint64_t *X1, uint64_t *Y1, uint64_t *Z)
 {
     uint64_t t1[MAX_NUM_ECC_DIGITS];
 
@@ -892,7 +1211,8 @@ static void apply_z(EccState *s,uint64_t *X1, uint64_t *Y1, uint64_t *Z)
 }
 
 /* P = (x1, y1) => 2P, (x2, y2) => P' */
-static void XYcZ_initial_double(EccState *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint64_t *Y2, uint64_t *p_initialZ)
+template<class S>
+static void XYcZ_initial_double(S *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint64_t *Y2, uint64_t *p_initialZ)
 {
     uint64_t z[MAX_NUM_ECC_DIGITS];
     
@@ -917,7 +1237,8 @@ static void XYcZ_initial_double(EccState *s, uint64_t *X1, uint64_t *Y1, uint64_
    Output P' = (x1', y1', Z3), P + Q = (x3, y3, Z3)
    or P => P', Q => P + Q
 */
-static void XYcZ_add(EccState *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint64_t *Y2)
+template<class S>
+static void XYcZ_add(S *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint64_t *Y2)
 {
     /* t1 = X1, t2 = Y1, t3 = X2, t4 = Y2 */
     uint64_t t5[MAX_NUM_ECC_DIGITS];
@@ -944,7 +1265,8 @@ static void XYcZ_add(EccState *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint
    Output P + Q = (x3, y3, Z3), P - Q = (x3', y3', Z3)
    or P => P - Q, Q => P + Q
 */
-static void XYcZ_addC(EccState *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint64_t *Y2)
+template<class S>
+static void XYcZ_addC(S *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uint64_t *Y2)
 {
     /* t1 = X1, t2 = Y1, t3 = X2, t4 = Y2 */
     uint64_t t5[MAX_NUM_ECC_DIGITS];
@@ -977,7 +1299,8 @@ static void XYcZ_addC(EccState *s, uint64_t *X1, uint64_t *Y1, uint64_t *X2, uin
     vli_set(s, X1, t7);
 }
 
-static void EccPoint_mult(EccState *s, EccPoint *p_result, EccPoint *p_point, uint64_t *p_scalar, uint64_t *p_initialZ)
+template<class S>
+static void EccPoint_mult(S *s, EccPoint *p_result, EccPoint *p_point, uint64_t *p_scalar, uint64_t *p_initialZ)
 {
     /* R0 and R1 */
     uint64_t Rx[2][MAX_NUM_ECC_DIGITS];
@@ -1005,7 +1328,7 @@ static void EccPoint_mult(EccState *s, EccPoint *p_result, EccPoint *p_point, ui
     vli_modSub(s, z, Rx[1], Rx[0], s->curve_p); /* X1 - X0 */
     vli_modMult_fast(s, z, z, Ry[1-nb]);     /* Yb * (X1 - X0) */
     vli_modMult_fast(s, z, z, p_point->x);   /* xP * Yb * (X1 - X0) */
-    vli_modInv(s, z, z, s->curve_p);            /* 1 / (xP * Yb * (X1 - X0)) */
+    vli_modInv_fast(s, z, z);                   /* 1 / (xP * Yb * (X1 - X0)) */
     vli_modMult_fast(s, z, z, p_point->y);   /* yP / (xP * Yb * (X1 - X0)) */
     vli_modMult_fast(s, z, z, Rx[1-nb]);     /* Xb * yP / (xP * Yb * (X1 - X0)) */
     /* End 1/Z calculation */
@@ -1018,7 +1341,194 @@ static void EccPoint_mult(EccState *s, EccPoint *p_result, EccPoint *p_point, ui
     vli_set(s, p_result->y, Ry[0]);
 }
 
-static void ecc_bytes2native(EccState *s, uint64_t *p_native, const uint8_t *p_bytes)
+/* ------ Fixed-base multiplication ------ */
+
+/* Key generation always multiplies the generator, so ecc_precompute() builds
+   a table of j * 16^i * G (j = 1..15, affine) for each 4-bit window i of the
+   scalar. EccPoint_mult_base() then needs one table addition per window and
+   no doublings. The additions use the complete formulas of Renes, Costello
+   and Batina (http://eprint.iacr.org/2015/1060, algorithm 5, a = -3), so no
+   input is exceptional, and every lookup reads the whole window with masks. */
+
+#define ECC_BASE_BITS    4
+#define ECC_BASE_ENTRIES ((1 << ECC_BASE_BITS) - 1)
+
+static EccPoint *ecc_base_256 = 0;
+static EccPoint *ecc_base_384 = 0;
+
+static EccPoint **ecc_base_slot(int bytes)
+{
+    if(bytes == secp256r1)
+    {
+        return &ecc_base_256;
+    }
+    if(bytes == secp384r1)
+    {
+        return &ecc_base_384;
+    }
+    return 0;
+}
+
+static EccPoint *ecc_base_table(EccState *s)
+{
+    EccPoint **l_slot = ecc_base_slot(s->ECC_BYTES);
+    return l_slot ? *l_slot : 0;
+}
+
+/* (X1:Y1:Z1) += (x2, y2). Projective in and out; Q must not be the point at infinity. */
+template<class S>
+static void EccPoint_add_mixed(S *s, uint64_t *X1, uint64_t *Y1, uint64_t *Z1, EccPoint *Q)
+{
+    uint64_t t0[MAX_NUM_ECC_DIGITS], t1[MAX_NUM_ECC_DIGITS], t2[MAX_NUM_ECC_DIGITS];
+    uint64_t t3[MAX_NUM_ECC_DIGITS], t4[MAX_NUM_ECC_DIGITS];
+    uint64_t X3[MAX_NUM_ECC_DIGITS], Y3[MAX_NUM_ECC_DIGITS], Z3[MAX_NUM_ECC_DIGITS];
+    uint64_t *p = s->curve_p;
+
+    vli_modMult_fast(s, t0, X1, Q->x);   /* t0 = X1*x2 */
+    vli_modMult_fast(s, t1, Y1, Q->y);   /* t1 = Y1*y2 */
+    vli_modAdd(s, t3, Q->x, Q->y, p);
+    vli_modAdd(s, t4, X1, Y1, p);
+    vli_modMult_fast(s, t3, t3, t4);
+    vli_modAdd(s, t4, t0, t1, p);
+    vli_modSub(s, t3, t3, t4, p);        /* t3 = X1*y2 + x2*Y1 */
+    vli_modMult_fast(s, t4, Q->y, Z1);
+    vli_modAdd(s, t4, t4, Y1, p);        /* t4 = y2*Z1 + Y1 */
+    vli_modMult_fast(s, Y3, Q->x, Z1);
+    vli_modAdd(s, Y3, Y3, X1, p);        /* Y3 = x2*Z1 + X1 */
+    vli_modMult_fast(s, Z3, s->curve_b, Z1);
+    vli_modSub(s, X3, Y3, Z3, p);
+    vli_modAdd(s, Z3, X3, X3, p);
+    vli_modAdd(s, X3, X3, Z3, p);
+    vli_modSub(s, Z3, t1, X3, p);
+    vli_modAdd(s, X3, t1, X3, p);
+    vli_modMult_fast(s, Y3, s->curve_b, Y3);
+    vli_modAdd(s, t1, Z1, Z1, p);
+    vli_modAdd(s, t2, t1, Z1, p);        /* t2 = 3*Z1 */
+    vli_modSub(s, Y3, Y3, t2, p);
+    vli_modSub(s, Y3, Y3, t0, p);
+    vli_modAdd(s, t1, Y3, Y3, p);
+    vli_modAdd(s, Y3, t1, Y3, p);
+    vli_modAdd(s, t1, t0, t0, p);
+    vli_modAdd(s, t0, t1, t0, p);
+    vli_modSub(s, t0, t0, t2, p);
+    vli_modMult_fast(s, t1, t4, Y3);
+    vli_modMult_fast(s, t2, t0, Y3);
+    vli_modMult_fast(s, Y3, X3, Z3);
+    vli_modAdd(s, Y3, Y3, t2, p);
+    vli_modMult_fast(s, X3, t3, X3);
+    vli_modSub(s, X3, X3, t1, p);
+    vli_modMult_fast(s, Z3, t4, Z3);
+    vli_modMult_fast(s, t1, t3, t0);
+    vli_modAdd(s, Z3, Z3, t1, p);
+
+    vli_set(s, X1, X3);
+    vli_set(s, Y1, Y3);
+    vli_set(s, Z1, Z3);
+}
+
+/* (X:Y:Z) => (X/Z, Y/Z). The point at infinity comes out as (0, 0). */
+template<class S>
+static void EccPoint_to_affine(S *s, EccPoint *p_result, uint64_t *X, uint64_t *Y, uint64_t *Z)
+{
+    uint64_t l_zinv[MAX_NUM_ECC_DIGITS];
+
+    vli_modInv_fast(s, l_zinv, Z);
+    vli_modMult_fast(s, p_result->x, X, l_zinv);
+    vli_modMult_fast(s, p_result->y, Y, l_zinv);
+}
+
+/* p_result = p_window[p_digit - 1], or (0, 0) for digit 0, reading every entry. */
+template<class S>
+static void ecc_base_lookup(S *s, EccPoint *p_result, EccPoint *p_window, uint p_digit)
+{
+    uint i, j;
+
+    vli_clear(s, p_result->x);
+    vli_clear(s, p_result->y);
+    for(j = 1; j <= ECC_BASE_ENTRIES; ++j)
+    {
+        uint64_t l_mask = 0 - ((((uint64_t)(p_digit ^ j)) - 1) >> 63);
+        for(i = 0; i < s->NUM_ECC_DIGITS; ++i)
+        {
+            p_result->x[i] |= p_window[j - 1].x[i] & l_mask;
+            p_result->y[i] |= p_window[j - 1].y[i] & l_mask;
+        }
+    }
+}
+
+template<class S>
+static void EccPoint_mult_base(S *s, EccPoint *p_result, EccPoint *p_table, uint64_t *p_scalar)
+{
+    uint64_t X[MAX_NUM_ECC_DIGITS], Y[MAX_NUM_ECC_DIGITS], Z[MAX_NUM_ECC_DIGITS];
+    uint64_t X2[MAX_NUM_ECC_DIGITS], Y2[MAX_NUM_ECC_DIGITS], Z2[MAX_NUM_ECC_DIGITS];
+    EccPoint l_entry;
+    uint i, l_windows = s->ECC_BYTES * 8 / ECC_BASE_BITS;
+
+    /* start at infinity, (0 : 1 : 0) */
+    vli_clear(s, X);
+    vli_clear(s, Y);
+    vli_clear(s, Z);
+    Y[0] = 1;
+
+    for(i = 0; i < l_windows; ++i)
+    {
+        uint l_digit = (uint)(p_scalar[i / 16] >> (i % 16 * ECC_BASE_BITS)) & ECC_BASE_ENTRIES;
+        /* all ones unless the digit is 0, where the table add is discarded */
+        uint64_t l_mask = ((((uint64_t)l_digit) - 1) >> 63) - 1;
+
+        ecc_base_lookup(s, &l_entry, p_table + i * ECC_BASE_ENTRIES, l_digit);
+        vli_set(s, X2, X);
+        vli_set(s, Y2, Y);
+        vli_set(s, Z2, Z);
+        EccPoint_add_mixed(s, X2, Y2, Z2, &l_entry);
+        vli_select(s, X, X2, l_mask);
+        vli_select(s, Y, Y2, l_mask);
+        vli_select(s, Z, Z2, l_mask);
+    }
+
+    EccPoint_to_affine(s, p_result, X, Y, Z);
+}
+
+/* EccPoint_mult() and EccPoint_mult_base() on the fixed-width state when
+   the curve has one. */
+static void ecc_mult(EccState *s, EccPoint *p_result, EccPoint *p_point, uint64_t *p_scalar, uint64_t *p_initialZ)
+{
+    if(s->ECC_BYTES == secp256r1)
+    {
+        EccFixed<secp256r1> l_fixed(s);
+        EccPoint_mult(&l_fixed, p_result, p_point, p_scalar, p_initialZ);
+    }
+    else if(s->ECC_BYTES == secp384r1)
+    {
+        EccFixed<secp384r1> l_fixed(s);
+        EccPoint_mult(&l_fixed, p_result, p_point, p_scalar, p_initialZ);
+    }
+    else
+    {
+        EccPoint_mult(s, p_result, p_point, p_scalar, p_initialZ);
+    }
+}
+
+static void ecc_mult_base(EccState *s, EccPoint *p_result, EccPoint *p_table, uint64_t *p_scalar)
+{
+    if(s->ECC_BYTES == secp256r1)
+    {
+        EccFixed<secp256r1> l_fixed(s);
+        EccPoint_mult_base(&l_fixed, p_result, p_table, p_scalar);
+    }
+    else if(s->ECC_BYTES == secp384r1)
+    {
+        EccFixed<secp384r1> l_fixed(s);
+        EccPoint_mult_base(&l_fixed, p_result, p_table, p_scalar);
+    }
+    else
+    {
+        EccPoint_mult_base(s, p_result, p_table, p_scalar);
+    }
+}
+
+template<class S>
+static void ecc_bytes2native(S *s, uint64_t *p_native, const uint8_t *p_bytes)
 {
     unsigned i;
     for(i=0; i<s->NUM_ECC_DIGITS; ++i)
@@ -1029,7 +1539,8 @@ static void ecc_bytes2native(EccState *s, uint64_t *p_native, const uint8_t *p_b
     }
 }
 
-static void ecc_native2bytes(EccState *s, uint8_t *p_bytes, const uint64_t *p_native)
+template<class S>
+static void ecc_native2bytes(S *s, uint8_t *p_bytes, const uint64_t *p_native)
 {
     unsigned i;
     for(i=0; i<s->NUM_ECC_DIGITS; ++i)
@@ -1047,7 +1558,8 @@ static void ecc_native2bytes(EccState *s, uint8_t *p_bytes, const uint64_t *p_na
 }
 
 /* Compute a = sqrt(a) (mod curve_p). */
-static void mod_sqrt(EccState *s, uint64_t *a)
+template<class S>
+static void mod_sqrt(S *s, uint64_t *a)
 {
     unsigned i;
     uint64_t p1[MAX_NUM_ECC_DIGITS] = {1};
@@ -1067,47 +1579,87 @@ static void mod_sqrt(EccState *s, uint64_t *a)
     vli_set(s, a, l_result);
 }
 
-static void ecc_point_decompress(EccState *s, EccPoint *p_point, const uint8_t *p_compressed)
+/* Returns 0, or -1 if x is out of range or x^3 - 3x + b has no square root. */
+template<class S>
+static int ecc_point_decompress(S *s, EccPoint *p_point, const uint8_t *p_compressed)
 {
     uint64_t _3[MAX_NUM_ECC_DIGITS] = {3}; /* -a = 3 */
+    uint64_t l_rhs[MAX_NUM_ECC_DIGITS];
     ecc_bytes2native(s, p_point->x, p_compressed+1);
+    if(vli_cmp(s, s->curve_p, p_point->x) != 1)
+    {
+        return -1;
+    }
     
-    vli_modSquare_fast(s, p_point->y, p_point->x); /* y = x^2 */
-    vli_modSub(s, p_point->y, p_point->y, _3, s->curve_p); /* y = x^2 - 3 */
-    vli_modMult_fast(s, p_point->y, p_point->y, p_point->x); /* y = x^3 - 3x */
-    vli_modAdd(s, p_point->y, p_point->y, s->curve_b, s->curve_p); /* y = x^3 - 3x + b */
+    vli_modSquare_fast(s, l_rhs, p_point->x); /* y = x^2 */
+    vli_modSub(s, l_rhs, l_rhs, _3, s->curve_p); /* y = x^2 - 3 */
+    vli_modMult_fast(s, l_rhs, l_rhs, p_point->x); /* y = x^3 - 3x */
+    vli_modAdd(s, l_rhs, l_rhs, s->curve_b, s->curve_p); /* y = x^3 - 3x + b */
     
+    vli_set(s, p_point->y, l_rhs);
     mod_sqrt(s, p_point->y);
     
+    /* a non-residue gives a y with y^2 != x^3 - 3x + b */
+    vli_modSquare_fast(s, _3, p_point->y);
+    if(vli_cmp(s, _3, l_rhs) != 0)
+    {
+        return -1;
+    }
+    
     if((p_point->y[0] & 0x01) != (p_compressed[0] & 0x01))
     {
         vli_sub(s, p_point->y, s->curve_p, p_point->y);
     }
+    return 0;
+}
+
+/* ecc_point_decompress() on the fixed-width state when the curve has one. */
+static int ecc_decompress(EccState *s, EccPoint *p_point, const uint8_t *p_compressed)
+{
+    if(s->ECC_BYTES == secp256r1)
+    {
+        EccFixed<secp256r1> l_fixed(s);
+        return ecc_point_decompress(&l_fixed, p_point, p_compressed);
+    }
+    if(s->ECC_BYTES == secp384r1)
+    {
+        EccFixed<secp384r1> l_fixed(s);
+        return ecc_point_decompress(&l_fixed, p_point, p_compressed);
+    }
+    return ecc_point_decompress(s, p_point, p_compressed);
 }
 
 
+/* p_publicKey is an uncompressed (04 x y) or compressed (02/03 x) point. */
 int ecdh_shared_secret(EccState *s, const uint8_t *p_publicKey, uint32_t publicKeySize, uint8_t *p_secret)
 {
-	if(publicKeySize != s->ECC_BYTES*2+1 || p_publicKey[0] != 0x04)
-		return -1;
     EccPoint l_public;
+	if(publicKeySize == s->ECC_BYTES*2+1 && p_publicKey[0] == 0x04)
+	{
+		ecc_bytes2native(s, l_public.x, p_publicKey+1);
+		ecc_bytes2native(s, l_public.y, p_publicKey+1+s->ECC_BYTES);
+	}
+	else if(publicKeySize == s->ECC_BYTES+1 && (p_publicKey[0] == 0x02 || p_publicKey[0] == 0x03))
+	{
+		if(ecc_decompress(s, &l_public, p_publicKey) != 0)
+			return -1;
+	}
+	else
+		return -1;
     uint64_t l_random[MAX_NUM_ECC_DIGITS];
     
     if(!getRandomNumber(s, l_random))
     {
         return 0;
     }
-    ecc_bytes2native(s, l_public.x, p_publicKey+1);
-    ecc_bytes2native(s, l_public.y, p_publicKey+1+s->ECC_BYTES);
-    
     EccPoint l_product;
-    EccPoint_mult(s, &l_product, &l_public, s->privatekey, l_random);
+    ecc_mult(s, &l_product, &l_public, s->privatekey, l_random);
     
     ecc_native2bytes(s, p_secret, l_product.x);
     
     return EccPoint_isZero(s, &l_product) ? -1 : 0;
 }
-int ecc_init(EccState *s, int bytes)
+static int ecc_set_curve(EccState *s, int bytes)
 {
 	s->ECC_BYTES		= bytes;
 	s->NUM_ECC_DIGITS	= bytes/8;
@@ -1141,7 +1693,51 @@ int ecc_init(EccState *s, int bytes)
 	}
 	else
 		return -1;
-	
+	return 0;
+}
+
+/* Builds the fixed-base table used by ecc_init() for P-256 or P-384. Call once
+   before any handshake (tls_client::init_global does); without it key
+   generation falls back to the ladder. */
+int ecc_precompute(int bytes)
+{
+    EccState s;
+    EccPoint **l_slot = ecc_base_slot(bytes);
+    if(l_slot == 0 || ecc_set_curve(&s, bytes) != 0)
+        return -1;
+    if(*l_slot)
+        return 0;
+
+    uint i, j, l_windows = bytes * 8 / ECC_BASE_BITS;
+    EccPoint *l_table = new EccPoint[l_windows * ECC_BASE_ENTRIES];
+    EccPoint l_base = s.curve_G;
+    uint64_t X[MAX_NUM_ECC_DIGITS], Y[MAX_NUM_ECC_DIGITS], Z[MAX_NUM_ECC_DIGITS];
+
+    for(i = 0; i < l_windows; ++i)
+    {
+        vli_clear(&s, X);
+        vli_clear(&s, Y);
+        vli_clear(&s, Z);
+        Y[0] = 1;
+        for(j = 0; j < ECC_BASE_ENTRIES; ++j)
+        {
+            EccPoint_add_mixed(&s, X, Y, Z, &l_base);
+            EccPoint_to_affine(&s, &l_table[i * ECC_BASE_ENTRIES + j], X, Y, Z);
+        }
+        /* 16 * base starts the next window */
+        EccPoint_add_mixed(&s, X, Y, Z, &l_base);
+        EccPoint_to_affine(&s, &l_base, X, Y, Z);
+    }
+    *l_slot = l_table;
+    return 0;
+}
+
+int ecc_init(EccState *s, int bytes)
+{
+	if(ecc_set_curve(s, bytes) != 0)
+		return -1;
+	EccPoint *l_table = ecc_base_table(s);
+
     unsigned l_tries = 0;
     
     do
@@ -1156,7 +1752,10 @@ int ecc_init(EccState *s, int bytes)
         if(vli_cmp(s, s->curve_n, s->privatekey) != 1)
             vli_sub(s, s->privatekey, s->privatekey, s->curve_n);
 
-        EccPoint_mult(s, &s->publickey, &s->curve_G, s->privatekey, NULL);
+        if(l_table)
+            ecc_mult_base(s, &s->publickey, l_table, s->privatekey);
+        else
+            ecc_mult(s, &s->publickey, &s->curve_G, s->privatekey, NULL);
     } while(EccPoint_isZero(s, &s->publickey));
     
 	return 0;
@@ -1175,7 +1774,8 @@ int ecc_export_public_key(EccState *s, uint8_t *p_publicKey, uint32_t publicKeyS
 /* -------- ECDSA code -------- */
 
 /* Computes p_result = (p_left * p_right) % p_mod. */
-static void vli_modMult(EccState *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right, uint64_t *p_mod)
+template<class S>
+static void vli_modMult(S *s, uint64_t *p_result, uint64_t *p_left, uint64_t *p_right, uint64_t *p_mod)
 {
     uint64_t l_product[2 * MAX_NUM_ECC_DIGITS];
     uint64_t l_modMultiple[2 * MAX_NUM_ECC_DIGITS];
@@ -1304,7 +1904,10 @@ int ecdsa_verify(EccState *s, const uint8_t *p_publicKey, const uint8_t *p_hash,
     
     uint64_t l_r[MAX_NUM_ECC_DIGITS], l_s[MAX_NUM_ECC_DIGITS];
     
-    ecc_point_decompress(s, &l_public, p_publicKey);
+    if(ecc_point_decompress(s, &l_public, p_publicKey) != 0)
+    {
+        return 0;
+    }
     ecc_bytes2native(s, l_r, p_signature);
     ecc_bytes2native(s, l_s, p_signature + s->ECC_BYTES);
     
@@ -1374,3 +1977,81 @@ int ecdsa_verify(EccState *s, const uint8_t *p_publicKey, const uint8_t *p_hash,
     /* Accept only if v == r. */
     return (vli_cmp(s, rx, l_r) == 0);
 }
+
+#ifdef ECC_BENCHMARK
+#include <stdio.h>
+#include <time.h>
+/* Cost of the ECDH ladder and of fixed-base key generation on P-256 and P-384,
+   once through the generic EccState and once through EccFixed. The results
+   are compared first. Build a test program with ECC_BENCHMARK defined and call
+   ecc_benchmark(). */
+static void ecc_benchmark(void)
+{
+    static const int l_curves[] = {secp256r1, secp384r1};
+    uint n, i, pass;
+
+    for(n = 0; n < sizeof(l_curves) / sizeof(l_curves[0]); ++n)
+    {
+        EccState s;
+        EccPoint l_result[2];
+        uint64_t l_key[MAX_NUM_ECC_DIGITS];
+        const char *l_names[2] = {"generic", "fixed"};
+
+        ecc_precompute(l_curves[n]);
+        ecc_set_curve(&s, l_curves[n]);
+        memset(l_result, 0, sizeof(l_result));
+        for(i = 0; i < s.NUM_ECC_DIGITS; ++i)
+        {
+            l_key[i] = 0x9E3779B97F4A7C15ull * (i + 1);
+        }
+        l_key[s.NUM_ECC_DIGITS - 1] >>= 1;
+
+        EccPoint_mult(&s, &l_result[0], &s.curve_G, l_key, NULL);
+        ecc_mult(&s, &l_result[1], &s.curve_G, l_key, NULL);
+        if(memcmp(&l_result[0], &l_result[1], sizeof(EccPoint)))
+        {
+            printf("P-%d: MISMATCH\n", s.ECC_BYTES * 8);
+            continue;
+        }
+        for(pass = 0; pass < 2; ++pass)
+        {
+            clock_t l_start, l_ladder, l_base;
+            unsigned l_count = 0;
+
+            l_start = clock();
+            do
+            {
+                for(i = 0; i < 16; ++i)
+                {
+                    if(pass)
+                        ecc_mult(&s, &l_result[0], &s.curve_G, l_key, NULL);
+                    else
+                        EccPoint_mult(&s, &l_result[0], &s.curve_G, l_key, NULL);
+                }
+                l_count += 16;
+                l_ladder = clock() - l_start;
+            } while(l_ladder < CLOCKS_PER_SEC / 2);
+            l_ladder = l_ladder * 1000000 / CLOCKS_PER_SEC / l_count;
+
+            l_count = 0;
+            l_start = clock();
+            do
+            {
+                for(i = 0; i < 16; ++i)
+                {
+                    if(pass)
+                        ecc_mult_base(&s, &l_result[0], ecc_base_table(&s), l_key);
+                    else
+                        EccPoint_mult_base(&s, &l_result[0], ecc_base_table(&s), l_key);
+                }
+                l_count += 16;
+                l_base = clock() - l_start;
+            } while(l_base < CLOCKS_PER_SEC / 2);
+            l_base = l_base * 1000000 / CLOCKS_PER_SEC / l_count;
+
+            printf("P-%d %-8s: %6d us per shared secret, %6d us per key\n", s.ECC_BYTES * 8,
+                   l_names[pass], (int)l_ladder, (int)l_base);
+        }
+    }
+}
+#endif /* ECC_BENCHMARK */
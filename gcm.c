@@ -498,6 +498,90 @@ int aes_cipher( aes_context *ctx,
 
     return( 0 );
 }
+
+/******************************************************************************
+ *
+ *  AES_CIPHER2
+ *
+ *  Encrypts two consecutive 16-byte blocks at once. The two blocks are taken
+ *  through the rounds side by side so that the table lookups of one overlap
+ *  with those of the other instead of each round waiting on the previous
+ *  one. Counter mode only ever encrypts, so there is no decryption variant.
+ *
+ ******************************************************************************/
+#define AES_FLAST(rk, X0,X1,X2,X3,Y0,Y1,Y2,Y3)      \
+{                                               \
+    X0 = (rk)[0] ^                              \
+            ( (uint32_t) FSb[ ( Y0       ) & 0xFF ]       ) ^ \
+            ( (uint32_t) FSb[ ( Y1 >>  8 ) & 0xFF ] <<  8 ) ^ \
+            ( (uint32_t) FSb[ ( Y2 >> 16 ) & 0xFF ] << 16 ) ^ \
+            ( (uint32_t) FSb[ ( Y3 >> 24 ) & 0xFF ] << 24 );  \
+                                                \
+    X1 = (rk)[1] ^                              \
+            ( (uint32_t) FSb[ ( Y1       ) & 0xFF ]       ) ^ \
+            ( (uint32_t) FSb[ ( Y2 >>  8 ) & 0xFF ] <<  8 ) ^ \
+            ( (uint32_t) FSb[ ( Y3 >> 16 ) & 0xFF ] << 16 ) ^ \
+            ( (uint32_t) FSb[ ( Y0 >> 24 ) & 0xFF ] << 24 );  \
+                                                \
+    X2 = (rk)[2] ^                              \
+            ( (uint32_t) FSb[ ( Y2       ) & 0xFF ]       ) ^ \
+            ( (uint32_t) FSb[ ( Y3 >>  8 ) & 0xFF ] <<  8 ) ^ \
+            ( (uint32_t) FSb[ ( Y0 >> 16 ) & 0xFF ] << 16 ) ^ \
+            ( (uint32_t) FSb[ ( Y1 >> 24 ) & 0xFF ] << 24 );  \
+                                                \
+    X3 = (rk)[3] ^                              \
+            ( (uint32_t) FSb[ ( Y3       ) & 0xFF ]       ) ^ \
+            ( (uint32_t) FSb[ ( Y0 >>  8 ) & 0xFF ] <<  8 ) ^ \
+            ( (uint32_t) FSb[ ( Y1 >> 16 ) & 0xFF ] << 16 ) ^ \
+            ( (uint32_t) FSb[ ( Y2 >> 24 ) & 0xFF ] << 24 );  \
+}
+
+int aes_cipher2( aes_context *ctx,
+                 const uchar *input,    // two 16-byte input blocks
+                 uchar *output )        // two 16-byte output blocks
+{
+    uint32_t X0, X1, X2, X3, Y0, Y1, Y2, Y3;    // state of the first block
+    uint32_t X4, X5, X6, X7, Y4, Y5, Y6, Y7;    // state of the second block
+    uint32_t *RK;
+    int i;
+
+    RK = ctx->rk;
+
+    GET_UINT32_LE( X0, input,  0 ); X0 ^= RK[0];
+    GET_UINT32_LE( X1, input,  4 ); X1 ^= RK[1];
+    GET_UINT32_LE( X2, input,  8 ); X2 ^= RK[2];
+    GET_UINT32_LE( X3, input, 12 ); X3 ^= RK[3];
+    GET_UINT32_LE( X4, input, 16 ); X4 ^= RK[0];
+    GET_UINT32_LE( X5, input, 20 ); X5 ^= RK[1];
+    GET_UINT32_LE( X6, input, 24 ); X6 ^= RK[2];
+    GET_UINT32_LE( X7, input, 28 ); X7 ^= RK[3];
+    RK+=4;
+
+    for( i = (ctx->rounds >> 1) - 1; i > 0; i-- )
+    {
+        AES_FROUND(RK, Y0, Y1, Y2, Y3, X0, X1, X2, X3 );
+        AES_FROUND(RK, Y4, Y5, Y6, Y7, X4, X5, X6, X7 );
+        AES_FROUND(RK+4, X0, X1, X2, X3, Y0, Y1, Y2, Y3 );
+        AES_FROUND(RK+4, X4, X5, X6, X7, Y4, Y5, Y6, Y7 );
+        RK+=8;
+    }
+
+    AES_FROUND(RK, Y0, Y1, Y2, Y3, X0, X1, X2, X3 );
+    AES_FROUND(RK, Y4, Y5, Y6, Y7, X4, X5, X6, X7 );
+
+    AES_FLAST(RK+4, X0, X1, X2, X3, Y0, Y1, Y2, Y3 );
+    AES_FLAST(RK+4, X4, X5, X6, X7, Y4, Y5, Y6, Y7 );
+
+    PUT_UINT32_LE( X0, output,  0 );
+    PUT_UINT32_LE( X1, output,  4 );
+    PUT_UINT32_LE( X2, output,  8 );
+    PUT_UINT32_LE( X3, output, 12 );
+    PUT_UINT32_LE( X4, output, 16 );
+    PUT_UINT32_LE( X5, output, 20 );
+    PUT_UINT32_LE( X6, output, 24 );
+    PUT_UINT32_LE( X7, output, 28 );
+    return( 0 );
+}
 /* end of aes.c */
 
 
@@ -555,18 +639,28 @@ int aes_cipher( aes_context *ctx,
 *
 *******************************************************************************/
 #define GCM_AUTH_FAILURE    0x55555555  // authentication failure
+#define GCM_BULK_BLOCKS     4           // blocks per pass of the bulk path
+
+#define GCM_GHASH_AUTO      0   // CLMUL where the CPU has it, else TABLE8
+#define GCM_GHASH_TABLE8    1   // 64 KB of 8-bit tables, fastest portable mode
+#define GCM_GHASH_TABLE4    2   // Shoup's 4-bit HL/HH tables only, ~1.3 KB
+#define GCM_GHASH_CLMUL     3   // AES-NI/PCLMULQDQ, no GHASH tables at all
 typedef struct {
     int mode;               // cipher direction: encrypt/decrypt
     uint64_t len;           // cipher data length processed so far
     uint64_t add_len;       // total add data length
     uint64_t HL[16];        // precalculated lo-half HTable
     uint64_t HH[16];        // precalculated hi-half HTable
+    uint64_t PL[GCM_BULK_BLOCKS][16];   // lo-half HTables of H^1..H^4 (TABLE4)
+    uint64_t PH[GCM_BULK_BLOCKS][16];   // hi-half HTables of H^1..H^4 (TABLE4)
     uchar base_ectr[16];    // first counter-mode cipher output for tag
     uchar y[16];            // the current cipher-input IV|Counter value
     uchar buf[16];          // buf working value
     aes_context aes_ctx;    // cipher context used
+    int ghash;              // GHASH strategy in use, one of GCM_GHASH_*
+    uchar hw_h[8][16];      // byte-reflected H^1..H^8 for the clmul GHASH
 
-	uchar table[16][256][16];
+    uchar (*table)[256][16];    // 8-bit tables, allocated for TABLE8 only
 
 } gcm_context;
 
@@ -699,45 +793,322 @@ static void gcm_mult( gcm_context *ctx,     // pointer to established context
     PUT_UINT32_BE( zl >> 32, output, 8 );
     PUT_UINT32_BE( zl, output, 12 );
 }
+
+/******************************************************************************
+ *
+ *  GCM_MULT_BULK
+ *
+ *  Computes x[0]*H^4 ^ x[1]*H^3 ^ x[2]*H^2 ^ x[3]*H, which is the GHASH of
+ *  four consecutive blocks once the running hash has been XORed into x[0].
+ *  Shoup's method is Horner's rule over the nibbles, so the four products
+ *  can share a single shift-and-reduce per nibble and only the (mutually
+ *  independent) table lookups are repeated. Used by the 4-bit table mode.
+ *
+ ******************************************************************************/
+static void gcm_mult_bulk( gcm_context *ctx,
+                           uchar x[GCM_BULK_BLOCKS][16],
+                           uchar output[16] )
+{
+    int i, b;
+    uchar rem, n;
+    uint64_t zh = 0, zl = 0;
+
+    for( i = 15; i >= 0; i-- ) {
+        rem = (uchar) ( zl & 0x0f );
+        zl = ( zh << 60 ) | ( zl >> 4 );
+        zh = ( zh >> 4 ) ^ ( last4[rem] << 48 );
+        for( b = 0; b < GCM_BULK_BLOCKS; b++ ) {
+            n = (uchar) ( x[b][i] & 0x0f );
+            zl ^= ctx->PL[GCM_BULK_BLOCKS - 1 - b][n];
+            zh ^= ctx->PH[GCM_BULK_BLOCKS - 1 - b][n];
+        }
+
+        rem = (uchar) ( zl & 0x0f );
+        zl = ( zh << 60 ) | ( zl >> 4 );
+        zh = ( zh >> 4 ) ^ ( last4[rem] << 48 );
+        for( b = 0; b < GCM_BULK_BLOCKS; b++ ) {
+            n = (uchar) ( x[b][i] >> 4 );
+            zl ^= ctx->PL[GCM_BULK_BLOCKS - 1 - b][n];
+            zh ^= ctx->PH[GCM_BULK_BLOCKS - 1 - b][n];
+        }
+    }
+    PUT_UINT32_BE( zh >> 32, output, 0 );
+    PUT_UINT32_BE( zh, output, 4 );
+    PUT_UINT32_BE( zl >> 32, output, 8 );
+    PUT_UINT32_BE( zl, output, 12 );
+}
+
 static void gcm_mult_h( gcm_context *ctx, const uchar I[16], uchar output[16] )    // pointer to 128-bit output vector
 {
-	unsigned char T[16];
-	memcpy(T, &ctx->table[0][I[0]][0], 16);
-	for (int x = 1; x < 16; x++) 
-	   for (int y = 0; y < 16; y += sizeof(unsigned long))
-		   *((unsigned long *)(T + y)) ^= *((unsigned long *)(&ctx->table[x][I[x]][y]));
-	memcpy(output, T, 16);
+	// 64-bit lanes: 'unsigned long' is only 32 bits wide on Windows
+	uint64_t T0 = *((uint64_t *)(&ctx->table[0][I[0]][0]));
+	uint64_t T1 = *((uint64_t *)(&ctx->table[0][I[0]][8]));
+	for (int x = 1; x < 16; x++) {
+	   T0 ^= *((uint64_t *)(&ctx->table[x][I[x]][0]));
+	   T1 ^= *((uint64_t *)(&ctx->table[x][I[x]][8]));
+	}
+	*((uint64_t *)(output + 0)) = T0;
+	*((uint64_t *)(output + 8)) = T1;
 }
 
+// multiply by H with whichever portable tables this context has
+static void gcm_mult_x( gcm_context *ctx, const uchar x[16], uchar output[16] )
+{
+    if( ctx->table )
+        gcm_mult_h( ctx, x, output );
+    else
+        gcm_mult( ctx, x, output );
+}
 
 /******************************************************************************
  *
- *  GCM_SETKEY
+ *  AES-NI / PCLMULQDQ BACKEND
  *
- *  This is called to set the AES-GCM key. It initializes the AES key
- *  and populates the gcm context's pre-calculated HTables.
+ *  On x86 processors that have the AES-NI, PCLMULQDQ and SSSE3 extensions the
+ *  whole GCM pipeline runs on the hardware instructions: counter blocks go
+ *  through AESENC eight at a time using the round keys already expanded into
+ *  'aes_ctx' (their byte layout is exactly what AESENC expects), and GHASH is
+ *  a carry-less multiply with the reduction deferred over the eight blocks by
+ *  multiplying them by H^8..H^1. The choice is made once per key by CPUID in
+ *  GCM_SETKEY; everything else falls back to the portable code above.
+ *
+ *  GHASH values are kept byte-reflected inside the XMM registers, following
+ *  Intel's "Carry-Less Multiplication Instruction and its Usage for Computing
+ *  the GCM Mode" white paper. Define GCM_NO_AESNI to compile it out.
  *
  ******************************************************************************/
+#if !defined(GCM_NO_AESNI) && ( defined(_M_X64) || defined(_M_IX86) || \
+                                defined(__x86_64__) || defined(__i386__) )
+#define GCM_AESNI   1
+#endif
+
+#if GCM_AESNI
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GCM_AESNI_FN    static
+#else
+#include <cpuid.h>
+#define GCM_AESNI_FN    static __attribute__((target("sse2,ssse3,aes,pclmul")))
+#endif
+
+static int gcm_aesni_supported( void )
+{
+    static int supported = -1;  // cached CPUID result, -1 until first probed
+
+    if( supported < 0 ) {
+        uint32_t ecx = 0;
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid( info, 1 );
+        ecx = (uint32_t) info[2];
+#else
+        uint32_t eax, ebx, edx;
+        if( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) ) ecx = 0;
+#endif
+        // CPUID.1:ECX bit 1 = PCLMULQDQ, bit 9 = SSSE3, bit 25 = AES-NI
+        supported = ( ecx & 0x02000202 ) == 0x02000202;
+    }
+    return( supported );
+}
 
-int gcm_setkey( gcm_context *ctx,   // pointer to caller-provided gcm context
-                const uchar *key,   // pointer to the AES encryption key
-                const uint keysize) // size in bytes (must be 16, 24, 32 for
-		                    // 128, 192 or 256-bit keys respectively)
+// accumulate the unreduced 256-bit carry-less product a*b into hi:lo
+GCM_AESNI_FN void gcm_clmul_mul( __m128i a, __m128i b, __m128i *lo, __m128i *hi )
 {
-    int ret, i, j;
-    uint64_t hi, lo;
-    uint64_t vl, vh;
-    unsigned char h[16];
+    __m128i t0 = _mm_clmulepi64_si128( a, b, 0x00 );
+    __m128i t1 = _mm_clmulepi64_si128( a, b, 0x10 );
+    __m128i t2 = _mm_clmulepi64_si128( a, b, 0x01 );
+    __m128i t3 = _mm_clmulepi64_si128( a, b, 0x11 );
+
+    t1 = _mm_xor_si128( t1, t2 );
+    *lo = _mm_xor_si128( *lo, _mm_xor_si128( t0, _mm_slli_si128( t1, 8 ) ) );
+    *hi = _mm_xor_si128( *hi, _mm_xor_si128( t3, _mm_srli_si128( t1, 8 ) ) );
+}
 
-    memset( ctx, 0, sizeof(gcm_context) );  // zero caller-provided GCM context
-    memset( h, 0, 16 );                     // initialize the block to encrypt
+// shift the reflected product left one bit and reduce it modulo the GCM poly
+GCM_AESNI_FN __m128i gcm_clmul_reduce( __m128i lo, __m128i hi )
+{
+    __m128i t7, t8, t9;
+
+    t7 = _mm_srli_epi32( lo, 31 );
+    t8 = _mm_srli_epi32( hi, 31 );
+    lo = _mm_slli_epi32( lo, 1 );
+    hi = _mm_slli_epi32( hi, 1 );
+    t9 = _mm_srli_si128( t7, 12 );
+    t8 = _mm_slli_si128( t8, 4 );
+    t7 = _mm_slli_si128( t7, 4 );
+    lo = _mm_or_si128( lo, t7 );
+    hi = _mm_or_si128( _mm_or_si128( hi, t8 ), t9 );
+
+    t7 = _mm_xor_si128( _mm_xor_si128( _mm_slli_epi32( lo, 31 ),
+                                       _mm_slli_epi32( lo, 30 ) ),
+                                       _mm_slli_epi32( lo, 25 ) );
+    t8 = _mm_srli_si128( t7, 4 );
+    lo = _mm_xor_si128( lo, _mm_slli_si128( t7, 12 ) );
+
+    t9 = _mm_xor_si128( _mm_xor_si128( _mm_srli_epi32( lo, 1 ),
+                                       _mm_srli_epi32( lo, 2 ) ),
+                                       _mm_srli_epi32( lo, 7 ) );
+    lo = _mm_xor_si128( lo, _mm_xor_si128( t9, t8 ) );
+    return( _mm_xor_si128( hi, lo ) );
+}
 
-    // encrypt the null 128-bit block to generate a key-based value
-    // which is then used to initialize our GHASH lookup tables
-    if(( ret = aes_setkey( &ctx->aes_ctx, ENCRYPT, key, keysize )) != 0 )
-        return( ret );
-    if(( ret = aes_cipher( &ctx->aes_ctx, h, h )) != 0 )
-        return( ret );
+GCM_AESNI_FN __m128i gcm_clmul_bswap( __m128i x )
+{
+    return( _mm_shuffle_epi8( x, _mm_set_epi8( 0, 1, 2, 3, 4, 5, 6, 7,
+                                               8, 9,10,11,12,13,14,15 ) ) );
+}
+
+GCM_AESNI_FN __m128i gcm_aesni_block( const aes_context *aes, __m128i b )
+{
+    const __m128i *rk = (const __m128i *) aes->rk;
+    int i;
+
+    b = _mm_xor_si128( b, _mm_loadu_si128( rk ) );
+    for( i = 1; i < aes->rounds; i++ )
+        b = _mm_aesenc_si128( b, _mm_loadu_si128( rk + i ) );
+    return( _mm_aesenclast_si128( b, _mm_loadu_si128( rk + i ) ) );
+}
+
+// fill hw_h[] with H^1..H^8 from the hash subkey 'h'
+GCM_AESNI_FN void gcm_aesni_setkey( gcm_context *ctx, const uchar h[16] )
+{
+    __m128i H = gcm_clmul_bswap( _mm_loadu_si128( (const __m128i *) h ) );
+    __m128i P = H, lo, hi;
+    int i;
+
+    _mm_storeu_si128( (__m128i *) ctx->hw_h[0], H );
+    for( i = 1; i < 8; i++ ) {
+        lo = hi = _mm_setzero_si128();
+        gcm_clmul_mul( P, H, &lo, &hi );
+        P = gcm_clmul_reduce( lo, hi );
+        _mm_storeu_si128( (__m128i *) ctx->hw_h[i], P );
+    }
+}
+
+// x = GHASH of 'len' bytes at 'p' chained onto x, zero-padding the last block
+GCM_AESNI_FN void gcm_aesni_ghash( gcm_context *ctx, uchar x[16],
+                                   const uchar *p, size_t len )
+{
+    __m128i X = gcm_clmul_bswap( _mm_loadu_si128( (const __m128i *) x ) );
+    __m128i H = _mm_loadu_si128( (const __m128i *) ctx->hw_h[0] );
+    __m128i lo, hi;
+    uchar last[16];
+
+    while( len > 0 ) {
+        if( len >= 16 ) {
+            X = _mm_xor_si128( X, gcm_clmul_bswap(
+                               _mm_loadu_si128( (const __m128i *) p ) ) );
+            p += 16; len -= 16;
+        } else {
+            memset( last, 0, 16 );
+            memcpy( last, p, len );
+            X = _mm_xor_si128( X, gcm_clmul_bswap(
+                               _mm_loadu_si128( (const __m128i *) last ) ) );
+            len = 0;
+        }
+        lo = hi = _mm_setzero_si128();
+        gcm_clmul_mul( X, H, &lo, &hi );
+        X = gcm_clmul_reduce( lo, hi );
+    }
+    _mm_storeu_si128( (__m128i *) x, gcm_clmul_bswap( X ) );
+}
+
+GCM_AESNI_FN void gcm_aesni_update( gcm_context *ctx, size_t length,
+                                    const uchar *input, uchar *output )
+{
+    // swaps only the trailing 32-bit big-endian counter into a native lane
+    const __m128i ctr_swap = _mm_set_epi8( 12,13,14,15,11,10, 9, 8,
+                                            7, 6, 5, 4, 3, 2, 1, 0 );
+    const __m128i one = _mm_set_epi32( 1, 0, 0, 0 );
+    const __m128i *rk = (const __m128i *) ctx->aes_ctx.rk;
+    const int rounds = ctx->aes_ctx.rounds;
+    __m128i ctr = _mm_shuffle_epi8( _mm_loadu_si128( (__m128i *) ctx->y ), ctr_swap );
+    __m128i X = gcm_clmul_bswap( _mm_loadu_si128( (__m128i *) ctx->buf ) );
+    __m128i blk[8], c[8], k, lo, hi;
+    uchar tmp[16];
+    size_t use_len;
+    int i, r;
+
+    while( length >= 128 ) {
+        k = _mm_loadu_si128( rk );
+        for( i = 0; i < 8; i++ ) {
+            ctr = _mm_add_epi32( ctr, one );
+            blk[i] = _mm_xor_si128( _mm_shuffle_epi8( ctr, ctr_swap ), k );
+        }
+        for( r = 1; r < rounds; r++ ) {
+            k = _mm_loadu_si128( rk + r );
+            for( i = 0; i < 8; i++ ) blk[i] = _mm_aesenc_si128( blk[i], k );
+        }
+        k = _mm_loadu_si128( rk + rounds );
+        for( i = 0; i < 8; i++ ) {
+            __m128i in = _mm_loadu_si128( (const __m128i *) input + i );
+            __m128i out = _mm_xor_si128( _mm_aesenclast_si128( blk[i], k ), in );
+            _mm_storeu_si128( (__m128i *) output + i, out );
+            c[i] = gcm_clmul_bswap( ctx->mode == ENCRYPT ? out : in );
+        }
+
+        // ((X ^ C0)*H^8) ^ (C1*H^7) ^ ... ^ (C7*H) with a single reduction
+        lo = hi = _mm_setzero_si128();
+        c[0] = _mm_xor_si128( c[0], X );
+        for( i = 0; i < 8; i++ )
+            gcm_clmul_mul( c[i], _mm_loadu_si128( (const __m128i *) ctx->hw_h[7 - i] ),
+                           &lo, &hi );
+        X = gcm_clmul_reduce( lo, hi );
+
+        length -= 128;
+        input  += 128;
+        output += 128;
+    }
+
+    k = _mm_loadu_si128( (const __m128i *) ctx->hw_h[0] );
+    while( length > 0 ) {
+        use_len = ( length < 16 ) ? length : 16;
+
+        ctr = _mm_add_epi32( ctr, one );
+        _mm_storeu_si128( (__m128i *) tmp, gcm_aesni_block( &ctx->aes_ctx,
+                                         _mm_shuffle_epi8( ctr, ctr_swap ) ) );
+        for( i = 0; i < (int) use_len; i++ ) {
+            uchar o = (uchar) ( tmp[i] ^ input[i] );
+            tmp[i] = ( ctx->mode == ENCRYPT ) ? o : input[i];
+            output[i] = o;
+        }
+        for( ; i < 16; i++ ) tmp[i] = 0;
+
+        X = _mm_xor_si128( X, gcm_clmul_bswap( _mm_loadu_si128( (__m128i *) tmp ) ) );
+        lo = hi = _mm_setzero_si128();
+        gcm_clmul_mul( X, k, &lo, &hi );
+        X = gcm_clmul_reduce( lo, hi );
+
+        length -= use_len;
+        input  += use_len;
+        output += use_len;
+    }
+
+    _mm_storeu_si128( (__m128i *) ctx->y, _mm_shuffle_epi8( ctr, ctr_swap ) );
+    _mm_storeu_si128( (__m128i *) ctx->buf, gcm_clmul_bswap( X ) );
+}
+#endif /* GCM_AESNI */
+
+
+
+/******************************************************************************
+ *
+ *  GCM_SET_HTABLE
+ *
+ *  Populates a pair of Shoup 4-bit HTables (lo and hi halves) for the
+ *  multiplier 'h', which is H itself or one of its powers.
+ *
+ ******************************************************************************/
+static void gcm_set_htable( const uchar h[16],  // GF(2^128) multiplier
+                            uint64_t HL[16],    // lo-half HTable to fill
+                            uint64_t HH[16] )   // hi-half HTable to fill
+{
+    int i, j;
+    uint64_t hi, lo;
+    uint64_t vl, vh;
 
     GET_UINT32_BE( hi, h,  0  );    // pack h as two 64-bit ints, big-endian
     GET_UINT32_BE( lo, h,  4  );
@@ -747,26 +1118,123 @@ int gcm_setkey( gcm_context *ctx,   // pointer to caller-provided gcm context
     GET_UINT32_BE( lo, h,  12 );
     vl = (uint64_t) hi << 32 | lo;
 
-    ctx->HL[8] = vl;                // 8 = 1000 corresponds to 1 in GF(2^128)
-    ctx->HH[8] = vh;
-    ctx->HH[0] = 0;                 // 0 corresponds to 0 in GF(2^128)
-    ctx->HL[0] = 0;
+    HL[8] = vl;                     // 8 = 1000 corresponds to 1 in GF(2^128)
+    HH[8] = vh;
+    HH[0] = 0;                      // 0 corresponds to 0 in GF(2^128)
+    HL[0] = 0;
 
     for( i = 4; i > 0; i >>= 1 ) {
         uint32_t T = (uint32_t) ( vl & 1 ) * 0xe1000000U;
         vl  = ( vh << 63 ) | ( vl >> 1 );
         vh  = ( vh >> 1 ) ^ ( (uint64_t) T << 32);
-        ctx->HL[i] = vl;
-        ctx->HH[i] = vh;
+        HL[i] = vl;
+        HH[i] = vh;
     }
     for (i = 2; i < 16; i <<= 1 ) {
-        uint64_t *HiL = ctx->HL + i, *HiH = ctx->HH + i;
+        uint64_t *HiL = HL + i, *HiH = HH + i;
         vh = *HiH;
         vl = *HiL;
         for( j = 1; j < i; j++ ) {
-            HiH[j] = vh ^ ctx->HH[j];
-            HiL[j] = vl ^ ctx->HL[j];
+            HiH[j] = vh ^ HH[j];
+            HiL[j] = vl ^ HL[j];
+        }
+    }
+}
+
+
+/******************************************************************************
+ *
+ *  GCM_INIT_CTX
+ *
+ *  Prepares a fresh context for GCM_SETKEY_GHASH, which may then be called
+ *  on it any number of times. GCM_ZERO_CTX releases it again.
+ *
+ ******************************************************************************/
+void gcm_init_ctx( gcm_context *ctx )
+{
+    memset( ctx, 0, sizeof( gcm_context ) );
+}
+
+
+/******************************************************************************
+ *
+ *  GCM_SETKEY_GHASH
+ *
+ *  This is called to set the AES-GCM key. It initializes the AES key
+ *  and populates the gcm context's pre-calculated HTables for the
+ *  requested GHASH strategy:
+ *
+ *    GCM_GHASH_TABLE8  a 64 KB heap table per context, the fastest software
+ *    GCM_GHASH_TABLE4  only the 4-bit HL/HH tables kept inside the context
+ *    GCM_GHASH_CLMUL   carry-less multiply (and AES-NI), no tables at all
+ *    GCM_GHASH_AUTO    CLMUL when the CPU supports it, otherwise TABLE8
+ *
+ *  CLMUL on a CPU without it degrades to TABLE4, the other small mode.
+ *  The context must come from GCM_INIT_CTX or an earlier key; a new key
+ *  reuses or releases its table, and GCM_ZERO_CTX frees it.
+ *
+ ******************************************************************************/
+
+int gcm_setkey_ghash( gcm_context *ctx, // pointer to caller-provided gcm context
+                const uchar *key,   // pointer to the AES encryption key
+                const uint keysize, // size in bytes (must be 16, 24, 32 for
+		                    // 128, 192 or 256-bit keys respectively)
+                int ghash )         // GHASH strategy, one of GCM_GHASH_*
+{
+    int ret, i;
+    unsigned char h[16];
+    uchar (*table)[256][16] = ctx->table;   // left over from a previous key
+
+#if GCM_AESNI
+    if( ghash == GCM_GHASH_AUTO )
+        ghash = gcm_aesni_supported() ? GCM_GHASH_CLMUL : GCM_GHASH_TABLE8;
+    else if( ghash == GCM_GHASH_CLMUL && !gcm_aesni_supported() )
+        ghash = GCM_GHASH_TABLE4;
+#else
+    if( ghash == GCM_GHASH_AUTO )  ghash = GCM_GHASH_TABLE8;
+    if( ghash == GCM_GHASH_CLMUL ) ghash = GCM_GHASH_TABLE4;
+#endif
+    if( ghash != GCM_GHASH_TABLE8 && table ) {
+        free( table );
+        table = 0;
+    }
+
+    memset( ctx, 0, sizeof(gcm_context) );  // zero caller-provided GCM context
+    memset( h, 0, 16 );                     // initialize the block to encrypt
+    ctx->table = table;
+    ctx->ghash = ghash;
+
+    // encrypt the null 128-bit block to generate a key-based value
+    // which is then used to initialize our GHASH lookup tables
+    if(( ret = aes_setkey( &ctx->aes_ctx, ENCRYPT, key, keysize )) != 0 )
+        return( ret );
+    if(( ret = aes_cipher( &ctx->aes_ctx, h, h )) != 0 )
+        return( ret );
+
+    gcm_set_htable( h, ctx->HL, ctx->HH );
+
+#if GCM_AESNI
+    if( ghash == GCM_GHASH_CLMUL ) {
+        gcm_aesni_setkey( ctx, h );
+        return( 0 );
+    }
+#endif
+
+    if( ghash == GCM_GHASH_TABLE4 ) {
+        // HTables of H^1..H^4 for the bulk path of GCM_UPDATE
+        memcpy( ctx->PL[0], ctx->HL, sizeof(ctx->HL) );
+        memcpy( ctx->PH[0], ctx->HH, sizeof(ctx->HH) );
+        for( i = 1; i < GCM_BULK_BLOCKS; i++ ) {
+            gcm_mult( ctx, h, h );      // h = H^(i+1)
+            gcm_set_htable( h, ctx->PL[i], ctx->PH[i] );
         }
+        return( 0 );
+    }
+
+    if( ctx->table == 0 ) {
+        ctx->table = (uchar (*)[256][16]) malloc( 16 * 256 * 16 );
+        if( ctx->table == 0 )
+            return( -1 );
     }
 	
 	unsigned char b[16];
@@ -825,6 +1293,23 @@ int gcm_setkey( gcm_context *ctx,   // pointer to caller-provided gcm context
 	return( 0 );
 }
 
+/******************************************************************************
+ *
+ *  GCM_SETKEY
+ *
+ *  Sets the AES-GCM key with the fastest GHASH strategy available. As
+ *  before, the context may be uninitialized: whatever it held is ignored,
+ *  so call GCM_ZERO_CTX before keying a used context again.
+ *
+ ******************************************************************************/
+int gcm_setkey( gcm_context *ctx,   // pointer to caller-provided gcm context
+                const uchar *key,   // pointer to the AES encryption key
+                const uint keysize) // size in bytes (must be 16, 24 or 32)
+{
+    gcm_init_ctx( ctx );
+    return( gcm_setkey_ghash( ctx, key, keysize, GCM_GHASH_AUTO ) );
+}
+
 
 /******************************************************************************
  *
@@ -879,26 +1364,41 @@ int gcm_start( gcm_context *ctx,    // pointer to user-provided GCM context
         memset( work_buf, 0x00, 16 );               // clear the working buffer
         PUT_UINT32_BE( iv_len * 8, work_buf, 12 );  // place the IV into buffer
 
+#if GCM_AESNI
+        if( ctx->ghash == GCM_GHASH_CLMUL ) {
+            gcm_aesni_ghash( ctx, ctx->y, iv, iv_len );
+            gcm_aesni_ghash( ctx, ctx->y, work_buf, 16 );
+            iv_len = 0;
+        }
+#endif
         p = iv;
         while( iv_len > 0 ) {
             use_len = ( iv_len < 16 ) ? iv_len : 16;
             for( i = 0; i < use_len; i++ ) ctx->y[i] ^= p[i];
-				gcm_mult_h( ctx, ctx->y, ctx->y );
+				gcm_mult_x( ctx, ctx->y, ctx->y );
             iv_len -= use_len;
             p += use_len;
         }
-        for( i = 0; i < 16; i++ ) ctx->y[i] ^= work_buf[i];
-			gcm_mult_h( ctx, ctx->y, ctx->y );
+        if( ctx->ghash != GCM_GHASH_CLMUL ) {
+            for( i = 0; i < 16; i++ ) ctx->y[i] ^= work_buf[i];
+			gcm_mult_x( ctx, ctx->y, ctx->y );
+        }
     }
     if( ( ret = aes_cipher( &ctx->aes_ctx, ctx->y, ctx->base_ectr ) ) != 0 )
         return( ret );
 
     ctx->add_len = add_len;
+#if GCM_AESNI
+    if( ctx->ghash == GCM_GHASH_CLMUL ) {
+        gcm_aesni_ghash( ctx, ctx->buf, add, add_len );
+        return( 0 );
+    }
+#endif
     p = add;
     while( add_len > 0 ) {
         use_len = ( add_len < 16 ) ? add_len : 16;
         for( i = 0; i < use_len; i++ ) ctx->buf[i] ^= p[i];
-			gcm_mult_h( ctx, ctx->buf, ctx->buf );
+			gcm_mult_x( ctx, ctx->buf, ctx->buf );
         add_len -= use_len;
         p += use_len;
     }
@@ -923,11 +1423,60 @@ int gcm_update( gcm_context *ctx,       // pointer to user-provided GCM context
 {
     int ret;            // our error return if the AES encrypt fails
     uchar ectr[16];     // counter-mode cipher output for XORing
+    uchar bulk[GCM_BULK_BLOCKS][16];    // counter blocks of the bulk path
     size_t use_len;     // byte count to process, up to 16 bytes
-    size_t i;           // local loop iterator
+    size_t i, b;        // local loop iterators
 
     ctx->len += length; // bump the GCM context's running length count
 
+#if GCM_AESNI
+    if( ctx->ghash == GCM_GHASH_CLMUL ) {     // AES-NI/PCLMULQDQ bulk path selected by gcm_setkey
+        gcm_aesni_update( ctx, length, input, output );
+        return( 0 );
+    }
+#endif
+
+    // bulk path: build GCM_BULK_BLOCKS counter blocks up front, encrypt them
+    // in interleaved pairs, then XOR and GHASH the whole group; the loop
+    // below is only left with the final partial group
+    while( length >= GCM_BULK_BLOCKS * 16 ) {
+        for( b = 0; b < GCM_BULK_BLOCKS; b++ ) {
+            for( i = 16; i > 12; i-- ) if( ++ctx->y[i - 1] != 0 ) break;
+            memcpy( bulk[b], ctx->y, 16 );
+        }
+        for( b = 0; b < GCM_BULK_BLOCKS; b += 2 )
+            aes_cipher2( &ctx->aes_ctx, bulk[b], bulk[b] );
+
+        if( ctx->table ) {  // 8-bit tables: one cheap multiply per block
+            for( b = 0; b < GCM_BULK_BLOCKS; b++ ) {
+                for( i = 0; i < 16; i += sizeof(uint64_t) ) {
+                    uint64_t in  = *(uint64_t*)&input[i];   // read before the
+                    uint64_t out = *(uint64_t*)&bulk[b][i] ^ in; // in-place write
+                    *(uint64_t*)&ctx->buf[i] ^= ( ctx->mode == ENCRYPT ) ? out : in;
+                    *(uint64_t*)&output[i] = out;
+                }
+                gcm_mult_h( ctx, ctx->buf, ctx->buf );
+                input  += 16;
+                output += 16;
+            }
+        }
+        else {              // 4-bit tables: fold the group over H^4..H^1
+            for( b = 0; b < GCM_BULK_BLOCKS; b++ ) {
+                for( i = 0; i < 16; i += sizeof(uint64_t) ) {
+                    uint64_t in  = *(uint64_t*)&input[i];
+                    uint64_t out = *(uint64_t*)&bulk[b][i] ^ in;
+                    *(uint64_t*)&bulk[b][i] = ( ctx->mode == ENCRYPT ) ? out : in;
+                    *(uint64_t*)&output[i] = out;
+                }
+                input  += 16;
+                output += 16;
+            }
+            for( i = 0; i < 16; i++ ) bulk[0][i] ^= ctx->buf[i];
+            gcm_mult_bulk( ctx, bulk, ctx->buf );
+        }
+        length -= GCM_BULK_BLOCKS * 16;
+    }
+
     while( length > 0 ) {
         // clamp the length to process at 16 bytes
         use_len = ( length < 16 ) ? length : 16;
@@ -963,7 +1512,7 @@ int gcm_update( gcm_context *ctx,       // pointer to user-provided GCM context
              }
         }
 		
-		gcm_mult_h(ctx, ctx->buf, ctx->buf);
+		gcm_mult_x(ctx, ctx->buf, ctx->buf);
 
         length -= use_len;  // drop the remaining byte count to process
         input  += use_len;  // bump our input pointer forward
@@ -999,8 +1548,15 @@ int gcm_finish( gcm_context *ctx,   // pointer to user-provided GCM context
         PUT_UINT32_BE( ( orig_len     >> 32 ), work_buf, 8  );
         PUT_UINT32_BE( ( orig_len           ), work_buf, 12 );
 
-        for( i = 0; i < 16; i++ ) ctx->buf[i] ^= work_buf[i];
-        gcm_mult_h( ctx, ctx->buf, ctx->buf );
+#if GCM_AESNI
+        if( ctx->ghash == GCM_GHASH_CLMUL )
+            gcm_aesni_ghash( ctx, ctx->buf, work_buf, 16 );
+        else
+#endif
+        {
+            for( i = 0; i < 16; i++ ) ctx->buf[i] ^= work_buf[i];
+            gcm_mult_x( ctx, ctx->buf, ctx->buf );
+        }
         for( i = 0; i < tag_len; i++ ) tag[i] ^= ctx->buf[i];
     }
     return( 0 );
@@ -1100,11 +1656,16 @@ int gcm_auth_decrypt(
  *
  *  The GCM context contains both the GCM context and the AES context.
  *  This includes keying and key-related material which is security-
- *  sensitive, so it MUST be zeroed after use. This function does that.
+ *  sensitive, so it MUST be zeroed after use. This function does that,
+ *  and also frees the 8-bit GHASH tables of a GCM_GHASH_TABLE8 context.
  *
  ******************************************************************************/
 void gcm_zero_ctx( gcm_context *ctx )
 {
+    if( ctx->table ) {      // release (and wipe) the 8-bit GHASH tables
+        memset( ctx->table, 0, 16 * 256 * 16 );
+        free( ctx->table );
+    }
     // zero the context originally provided to us
     memset( ctx, 0, sizeof( gcm_context ) );
 }
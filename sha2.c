@@ -231,6 +231,276 @@ static const uint64 sha512_k[80] =
              0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
              0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL};
 
+/*
+ * Hardware back-ends, chosen once at run time:
+ *  - SHA-256 with the x86 SHA extensions (SHA-NI) or the ARMv8 crypto
+ *    extensions;
+ *  - SHA-512/384 with the message schedule computed four words at a time
+ *    in AVX2 registers, the rounds staying scalar.
+ * Define SHA2_NO_ACCEL to keep only the portable code below.
+ */
+
+#if !defined(SHA2_NO_ACCEL) && (defined(_M_X64) || defined(_M_IX86) || \
+                                defined(__x86_64__) || defined(__i386__))
+#define SHA2_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SHA2_SHANI_FN   static
+#define SHA2_AVX2_FN    static
+#else
+#include <cpuid.h>
+#define SHA2_SHANI_FN   static __attribute__((target("sse4.1,ssse3,sha")))
+#define SHA2_AVX2_FN    static __attribute__((target("avx2")))
+#endif
+#elif !defined(SHA2_NO_ACCEL) && (defined(_M_ARM64) || \
+      (defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))))
+#define SHA2_ARM 1
+#include <arm_neon.h>
+#endif
+
+#define SHA2_ACCEL_SHA256   1   /* SHA-NI or ARMv8 SHA256H */
+#define SHA2_ACCEL_SHA512   2   /* AVX2 message schedule */
+
+static int sha2_accel(void)
+{
+    static int accel = -1;  /* cached feature bits, -1 until probed */
+
+    if (accel < 0) {
+        int found = 0;
+#if SHA2_X86
+        uint32 ecx1, ebx7 = 0, xcr0 = 0, r[4];
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        r[0] = (uint32) info[0];
+        __cpuid(info, 1);
+        ecx1 = (uint32) info[2];
+        if (r[0] >= 7) {
+            __cpuidex(info, 7, 0);
+            ebx7 = (uint32) info[1];
+        }
+        if (ecx1 & (1U << 27))
+            xcr0 = (uint32) _xgetbv(0);
+#else
+        if (!__get_cpuid(1, &r[0], &r[1], &ecx1, &r[3]))
+            ecx1 = 0;
+        if (__get_cpuid_max(0, 0) >= 7)
+            __cpuid_count(7, 0, r[0], ebx7, r[2], r[3]);
+        if (ecx1 & (1U << 27))
+            __asm__ __volatile__("xgetbv" : "=a"(xcr0), "=d"(r[3]) : "c"(0));
+#endif
+        /* CPUID.7:EBX bit 29 = SHA, CPUID.1:ECX bit 9 = SSSE3, bit 19 = SSE4.1 */
+        if ((ebx7 & (1U << 29)) && (ecx1 & 0x00080200) == 0x00080200)
+            found |= SHA2_ACCEL_SHA256;
+        /* CPUID.7:EBX bit 5 = AVX2, and the OS must save YMM state */
+        if ((ebx7 & (1U << 5)) && (xcr0 & 0x06) == 0x06)
+            found |= SHA2_ACCEL_SHA512;
+#elif SHA2_ARM
+#if defined(_M_ARM64)
+        if (IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE))
+            found |= SHA2_ACCEL_SHA256;
+#else
+        found |= SHA2_ACCEL_SHA256;     /* the compiler was told the CPU has it */
+#endif
+#endif
+        accel = found;
+    }
+    return accel;
+}
+
+#if SHA2_X86
+SHA2_SHANI_FN void sha256_transf_shani(uint32 *h, const uint8 *message,
+    uint64 block_nb)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, m0, m1, m2, m3;
+
+    /* h[0..7] = ABCD EFGH -> the ABEF / CDGH layout SHA256RNDS2 wants */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+/* four rounds on message words w (already in schedule order) */
+#define SHANI_RNDS4(w, j)                                                  \
+    msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *) &sha256_k[j])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                   \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                    \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+/* next = W[t..t+3] from the partial sum in next and the last two groups */
+#define SHANI_SCHED(next, cur, prev)                                       \
+    next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4));             \
+    next = _mm_sha256msg2_epu32(next, cur);
+
+    while (block_nb--) {
+        abef = state0;
+        cdgh = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (message +  0)), mask);
+        SHANI_RNDS4(m0, 0);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (message + 16)), mask);
+        SHANI_RNDS4(m1, 4);
+        m0 = _mm_sha256msg1_epu32(m0, m1);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (message + 32)), mask);
+        SHANI_RNDS4(m2, 8);
+        m1 = _mm_sha256msg1_epu32(m1, m2);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (message + 48)), mask);
+        SHANI_RNDS4(m3, 12);
+        SHANI_SCHED(m0, m3, m2);
+        m2 = _mm_sha256msg1_epu32(m2, m3);
+
+        SHANI_RNDS4(m0, 16); SHANI_SCHED(m1, m0, m3); m3 = _mm_sha256msg1_epu32(m3, m0);
+        SHANI_RNDS4(m1, 20); SHANI_SCHED(m2, m1, m0); m0 = _mm_sha256msg1_epu32(m0, m1);
+        SHANI_RNDS4(m2, 24); SHANI_SCHED(m3, m2, m1); m1 = _mm_sha256msg1_epu32(m1, m2);
+        SHANI_RNDS4(m3, 28); SHANI_SCHED(m0, m3, m2); m2 = _mm_sha256msg1_epu32(m2, m3);
+        SHANI_RNDS4(m0, 32); SHANI_SCHED(m1, m0, m3); m3 = _mm_sha256msg1_epu32(m3, m0);
+        SHANI_RNDS4(m1, 36); SHANI_SCHED(m2, m1, m0); m0 = _mm_sha256msg1_epu32(m0, m1);
+        SHANI_RNDS4(m2, 40); SHANI_SCHED(m3, m2, m1); m1 = _mm_sha256msg1_epu32(m1, m2);
+        SHANI_RNDS4(m3, 44); SHANI_SCHED(m0, m3, m2); m2 = _mm_sha256msg1_epu32(m2, m3);
+        SHANI_RNDS4(m0, 48); SHANI_SCHED(m1, m0, m3); m3 = _mm_sha256msg1_epu32(m3, m0);
+        SHANI_RNDS4(m1, 52); SHANI_SCHED(m2, m1, m0);
+        SHANI_RNDS4(m2, 56); SHANI_SCHED(m3, m2, m1);
+        SHANI_RNDS4(m3, 60);
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        message += SHA256_BLOCK_SIZE;
+    }
+#undef SHANI_RNDS4
+#undef SHANI_SCHED
+
+    /* back to ABCD EFGH */
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+/* 64-bit lane rotate and the two SHA-512 message sigmas */
+#define SHA512_VROR(x, n)   _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#define SHA512_VS0(x)       _mm256_xor_si256(_mm256_xor_si256(SHA512_VROR(x,  1), SHA512_VROR(x,  8)), _mm256_srli_epi64(x, 7))
+#define SHA512_VS1(x)       _mm256_xor_si256(_mm256_xor_si256(SHA512_VROR(x, 19), SHA512_VROR(x, 61)), _mm256_srli_epi64(x, 6))
+
+/*
+ * x0 = W[t..t+3] = s1(W[t-2..t+1]) + W[t-7..t-4] + s0(W[t-15..t-12]) + W[t-16..t-13]
+ * with x0..x3 holding W[t-16..t-1]. s1 of the upper two words needs the two
+ * words just produced, so it is done in two halves.
+ */
+#define SHA512_VSCHED(x0, x1, x2, x3)                                                   \
+{                                                                                      \
+    y = _mm256_alignr_epi8(_mm256_permute2x128_si256(x0, x1, 0x21), x0, 8);           \
+    z = _mm256_alignr_epi8(_mm256_permute2x128_si256(x2, x3, 0x21), x2, 8);           \
+    sum = _mm256_add_epi64(_mm256_add_epi64(x0, z), SHA512_VS0(y));                   \
+    lo = _mm256_add_epi64(sum, SHA512_VS1(_mm256_permute4x64_epi64(x3, 0xEE)));       \
+    sum = _mm256_add_epi64(sum, SHA512_VS1(_mm256_permute4x64_epi64(lo, 0x44)));      \
+    x0 = _mm256_blend_epi32(lo, sum, 0xF0);                                           \
+}
+
+#define SHA512_VSTORE(x, j)                                                             \
+    _mm256_storeu_si256((__m256i *) &wk[j], _mm256_add_epi64(x,                        \
+        _mm256_loadu_si256((const __m256i *) &sha512_k[j])))
+
+SHA2_AVX2_FN void sha512_transf_avx2(uint64 *h, const uint8 *message,
+    uint64 block_nb)
+{
+    const __m256i bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    uint64 wk[80];
+    uint64 wv[8];
+    uint64 t1, t2;
+    __m256i x0, x1, x2, x3, y, z, sum, lo;
+    int j;
+
+    while (block_nb--) {
+        x0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (message +  0)), bswap);
+        x1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (message + 32)), bswap);
+        x2 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (message + 64)), bswap);
+        x3 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (message + 96)), bswap);
+        SHA512_VSTORE(x0, 0);
+        SHA512_VSTORE(x1, 4);
+        SHA512_VSTORE(x2, 8);
+        SHA512_VSTORE(x3, 12);
+
+        wv[0] = h[0]; wv[1] = h[1];
+        wv[2] = h[2]; wv[3] = h[3];
+        wv[4] = h[4]; wv[5] = h[5];
+        wv[6] = h[6]; wv[7] = h[7];
+
+        /* the next sixteen schedule words overlap with the current rounds */
+        for (j = 0; j < 80; j += 8) {
+            if (!(j & 8) && j < 64) {
+                SHA512_VSCHED(x0, x1, x2, x3); SHA512_VSTORE(x0, j + 16);
+                SHA512_VSCHED(x1, x2, x3, x0); SHA512_VSTORE(x1, j + 20);
+                SHA512_VSCHED(x2, x3, x0, x1); SHA512_VSTORE(x2, j + 24);
+                SHA512_VSCHED(x3, x0, x1, x2); SHA512_VSTORE(x3, j + 28);
+            }
+#define SHA512_WK(a, b, c, d, e, f, g, h, k)                         \
+            t1 = wv[h] + SHA512_F2(wv[e]) + CH(wv[e], wv[f], wv[g]) + wk[k]; \
+            t2 = SHA512_F1(wv[a]) + MAJ(wv[a], wv[b], wv[c]);        \
+            wv[d] += t1;                                             \
+            wv[h] = t1 + t2;
+            SHA512_WK(0,1,2,3,4,5,6,7,j + 0);
+            SHA512_WK(7,0,1,2,3,4,5,6,j + 1);
+            SHA512_WK(6,7,0,1,2,3,4,5,j + 2);
+            SHA512_WK(5,6,7,0,1,2,3,4,j + 3);
+            SHA512_WK(4,5,6,7,0,1,2,3,j + 4);
+            SHA512_WK(3,4,5,6,7,0,1,2,j + 5);
+            SHA512_WK(2,3,4,5,6,7,0,1,j + 6);
+            SHA512_WK(1,2,3,4,5,6,7,0,j + 7);
+#undef SHA512_WK
+        }
+
+        h[0] += wv[0]; h[1] += wv[1];
+        h[2] += wv[2]; h[3] += wv[3];
+        h[4] += wv[4]; h[5] += wv[5];
+        h[6] += wv[6]; h[7] += wv[7];
+        message += SHA512_BLOCK_SIZE;
+    }
+    _mm256_zeroupper();
+}
+#endif /* SHA2_X86 */
+
+#if SHA2_ARM
+static void sha256_transf_arm(uint32 *h, const uint8 *message,
+    uint64 block_nb)
+{
+    uint32x4_t state0, state1, abcd, efgh, wk, tmp, m[4];
+    int g;
+
+    state0 = vld1q_u32(&h[0]);
+    state1 = vld1q_u32(&h[4]);
+
+    while (block_nb--) {
+        abcd = state0;
+        efgh = state1;
+        for (g = 0; g < 4; g++)
+            m[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(message + 16 * g)));
+
+        /* group g runs rounds 4g..4g+3 and, until the last four groups,
+           turns m[g] into the words for rounds 4g+16..4g+19 */
+        for (g = 0; g < 16; g++) {
+            wk = vaddq_u32(m[g & 3], vld1q_u32(&sha256_k[4 * g]));
+            if (g < 12)
+                m[g & 3] = vsha256su0q_u32(m[g & 3], m[(g + 1) & 3]);
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, tmp, wk);
+            if (g < 12)
+                m[g & 3] = vsha256su1q_u32(m[g & 3], m[(g + 2) & 3], m[(g + 3) & 3]);
+        }
+
+        state0 = vaddq_u32(state0, abcd);
+        state1 = vaddq_u32(state1, efgh);
+        message += SHA256_BLOCK_SIZE;
+    }
+
+    vst1q_u32(&h[0], state0);
+    vst1q_u32(&h[4], state1);
+}
+#endif /* SHA2_ARM */
+
 /* SHA-2 internal function */
 
 static void sha256_transf(sha256_ctx *ctx, const uint8 *message,
@@ -246,6 +516,18 @@ static void sha256_transf(sha256_ctx *ctx, const uint8 *message,
     int j;
 #endif
 
+#if SHA2_X86
+    if (sha2_accel() & SHA2_ACCEL_SHA256) {
+        sha256_transf_shani(ctx->h, message, block_nb);
+        return;
+    }
+#elif SHA2_ARM
+    if (sha2_accel() & SHA2_ACCEL_SHA256) {
+        sha256_transf_arm(ctx->h, message, block_nb);
+        return;
+    }
+#endif
+
     for (i = 0; i < block_nb; i++) {
         sub_block = message + (i << 6);
 
@@ -358,6 +640,13 @@ static void sha512_transf(sha512_ctx *ctx, const uint8 *message,
     uint64 i;
     int j;
 
+#if SHA2_X86
+    if (sha2_accel() & SHA2_ACCEL_SHA512) {
+        sha512_transf_avx2(ctx->h, message, block_nb);
+        return;
+    }
+#endif
+
     for (i = 0; i < block_nb; i++) {
         sub_block = message + (i << 7);
 
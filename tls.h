@@ -481,7 +481,9 @@ enum SSL_EXTENTION {
     EXT_SESSIONTICKET_TLS = 0x0023,     // Type: SessionTicket TLS(35)
 
     EXT_PRESHARED_KEY = 0x0029,         // Type: 41	pre_shared_key CH, SH Y [RFC8446]
+    EXT_EARLY_DATA = 0x002A,            // Type: 42	early_data CH, EE, NST Y [RFC8446]
     EXT_SUPPORTED_VERSION = 0x002B,     // Type: supported_versions	CH, SH, HRR	Y [RFC8446]
+    EXT_COOKIE = 0x002C,                // Type: cookie	CH, HRR	Y [RFC8446]
     EXT_PSK_KEY_EXCHANGE_MODES = 0x002D,// Type: psk_key_exchange_modes	CH	Y [RFC8446]
     EXT_KEY_SHARE = 0x0033,             // Type: key_share	CH, SH, HRR	Y [RFC8446]
 
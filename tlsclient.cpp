@@ -3,10 +3,13 @@
 #include <WinSock2.h>
 #include <windows.h>
 #include <stdint.h>
-#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
 #include "chacha20.c"
 #include "tls.h"
 #include "ecc.c"
+#include "curve25519.c"
 #include "gcm.c"
 #include "sha2.c"
 #include "lock.h"
@@ -130,6 +133,39 @@ enum tls_version
 	tls13 = 0x304,
 };
 
+// TLS 1.3 resumption with tickets from earlier connections to the same host:port
+enum tls_resumption
+{
+	resume_none		= 0,
+	resume_psk_dhe	= 1,	// PSK plus a fresh ECDHE share (psk_dhe_ke)
+	resume_psk		= 2,	// also offer psk_ke, which skips the ECDH
+};
+
+// What became of the bytes given to tls_client::set_early_data()
+enum tls_early_data
+{
+	early_none		= 0,	// no early data was set
+	early_accepted	= 1,	// the server took them in the first flight
+	early_rejected	= 2,	// not sent or not accepted: send() them again
+};
+
+// How tls_client::send() sizes application data records
+enum tls_record_sizing
+{
+	record_fixed	= 0,	// every record up to the maximum size
+	record_dynamic	= 1,	// one TCP segment per record until the connection is warm
+};
+
+// What a tls_client::set_trace() callback is handed
+enum tls_trace_event
+{
+	trace_record_out	= 0,	// records as written to the socket, one or more per call
+	trace_plaintext_out	= 1,	// application data of one record, before encryption
+	trace_record_in		= 2,	// one record as received, before decryption
+	trace_plaintext_in	= 3,	// application data of one record, after decryption
+};
+typedef void (*tls_trace_fn)(void *ctx, tls_trace_event event, const char *data, int size);
+
 class tls_encoder
 {
 public:
@@ -138,10 +174,20 @@ public:
 	}
 	
 	virtual bool init(unsigned char *local_key, unsigned char *remote_key, unsigned char *local_iv, unsigned char *remote_iv, int key_length, bool tls_13) = 0;
-	virtual void encode(tlsbuf &out, const char *packet, int packet_size, const unsigned char *aad, int aad_size, bool tls_13) = 0;
-	virtual char *decode(tlsbuf_reader &in, tlsbuf &out, const unsigned char *aad, int aad_size, bool tls_13) = 0;
+	// encrypts in place: body is the record body of compute_size() bytes with
+	// the plaintext at body+explicit_iv_len(); fills in nonce and tag around it
+	virtual void encode(unsigned char *body, int packet_size, const unsigned char *aad, int aad_size, bool tls_13) = 0;
+	// decrypts in place; inout is left on the plaintext
+	virtual char *decode(tlsbuf_reader &inout, const unsigned char *aad, int aad_size, bool tls_13) = 0;
 	virtual int compute_size(int size, int encode_or_decode, bool tls_13) = 0;
 	virtual int iv_len(bool tls_13) = 0;
+	virtual int explicit_iv_len(bool tls_13)
+	{
+		return 0;
+	}
+	virtual void set_ghash(int ghash)		//GCM_GHASH_*, only aes-gcm uses it
+	{
+	}
 };
 
 class tls_encoder_aes:public tls_encoder
@@ -153,26 +199,43 @@ class tls_encoder_aes:public tls_encoder
 	unsigned char remote_aead_iv[iv_length+encryption_length];
 	gcm_context		aes_gcm_local;
 	gcm_context		aes_gcm_remote;
+	int				ghash;
 public:
+	tls_encoder_aes()
+	{
+		gcm_init_ctx(&aes_gcm_local);
+		gcm_init_ctx(&aes_gcm_remote);
+		ghash = GCM_GHASH_AUTO;
+	}
+	~tls_encoder_aes()
+	{
+		gcm_zero_ctx(&aes_gcm_local);
+		gcm_zero_ctx(&aes_gcm_remote);
+	}
+	void set_ghash(int ghash)
+	{
+		this->ghash = ghash;
+	}
 	bool init(unsigned char *local_key, unsigned char *remote_key, unsigned char *local_iv, unsigned char *remote_iv, int key_length, bool tls_13)
 	{
-		int res1 = gcm_setkey(&aes_gcm_local, local_key, key_length);
-		int res2 = gcm_setkey(&aes_gcm_remote, remote_key, key_length);
+		int res1 = gcm_setkey_ghash(&aes_gcm_local, local_key, key_length, ghash);
+		int res2 = gcm_setkey_ghash(&aes_gcm_remote, remote_key, key_length, ghash);
         memcpy(local_aead_iv, local_iv, iv_len(tls_13));
         memcpy(remote_aead_iv, remote_iv, iv_len(tls_13));
 
 		return res1 == 0 && res2 == 0;
 	}
 	
-	void encode(tlsbuf &out, const char *packet, int packet_size, const unsigned char *aad, int aad_size, bool tls_13)
+	void encode(unsigned char *body, int packet_size, const unsigned char *aad, int aad_size, bool tls_13)
 	{
 		unsigned char iv[iv_length+encryption_length];
+		unsigned char *data = body + explicit_iv_len(tls_13);
 		if(tls_13 == false)
 		{
 			memcpy(iv, local_aead_iv, iv_len(tls_13));
 			for(int i = iv_length; i < iv_length+encryption_length; i++)
 				iv[i] = rand()&0xff;
-			out.append(iv + iv_length, encryption_length);
+			memcpy(body, iv + iv_length, encryption_length);
 		}
 		else
 		{
@@ -183,17 +246,17 @@ public:
 		}
 
 
-		out.append_size(packet_size);
 		int ret = 0;
 		ret = gcm_start(&aes_gcm_local, ENCRYPT, iv, iv_length+encryption_length, aad, aad_size);
-		ret = gcm_update(&aes_gcm_local, packet_size, (unsigned char*)packet, (unsigned char*)out.buf + out.size - packet_size);
-		out.append_size(tag_length);
-		ret = gcm_finish(&aes_gcm_local, (unsigned char*)out.buf + out.size - tag_length, tag_length);
+		ret = gcm_update(&aes_gcm_local, packet_size, data, data);
+		ret = gcm_finish(&aes_gcm_local, data + packet_size, tag_length);
 	}
 
-	char *decode(tlsbuf_reader &in, tlsbuf &out, const unsigned char *aad, int aad_size, bool tls_13)
+	char *decode(tlsbuf_reader &in, const unsigned char *aad, int aad_size, bool tls_13)
 	{
 		int decode_length = compute_size(in.buf_size, 1, tls_13);
+		if(decode_length < 0)
+			return "´íÎóµÄ°ü";
 
 		unsigned char iv[iv_length+encryption_length];
 		if(tls_13 == false)
@@ -209,17 +272,19 @@ public:
 			aad_size -= encryption_length;
 		}
 		
-		out.set_size(decode_length);
+		unsigned char *data = (unsigned char*)in.buf + (tls_13 ? 0 : encryption_length);
 		unsigned char tag[tag_length];
 		int ret1 = gcm_start(&aes_gcm_remote, DECRYPT, iv, sizeof(iv), aad, aad_size);
-		int ret2 = gcm_update(&aes_gcm_remote, decode_length, (unsigned char*)in.buf + (tls_13 ? 0 : encryption_length), (unsigned char*)out.buf);
+		int ret2 = gcm_update(&aes_gcm_remote, decode_length, data, data);
 		int ret3 = gcm_finish(&aes_gcm_remote, (unsigned char*)tag, tag_length);
 
         if ((ret1) || (ret2) || (ret3)) 
 			return "´íÎóµÄ°ü";
         // check tag
-        if (memcmp(in.buf + (tls_13 ? 0 : encryption_length) + decode_length, tag, tag_length) )
+        if (memcmp(data + decode_length, tag, tag_length) )
 			return "Êý¾ÝÐ£ÑéÊ§°Ü";
+		in.buf		= (char*)data;
+		in.buf_size	= decode_length;
 		return 0;
 	}
 	virtual int compute_size(int size, int encode_or_decode, bool tls_13)
@@ -233,6 +298,10 @@ public:
 	{
 		return tls_13 ? iv_length + encryption_length : iv_length;
 	}
+	virtual int explicit_iv_len(bool tls_13)
+	{
+		return tls_13 ? 0 : encryption_length;
+	}
 };
 
 
@@ -260,26 +329,23 @@ public:
 		memcpy(remote_nonce, remote_iv, iv_length);
 		return true;
 	}
-	void encode(tlsbuf &out, const char *packet, int packet_size, const unsigned char *aad, int aad_size, bool tls_13)
+	void encode(unsigned char *body, int packet_size, const unsigned char *aad, int aad_size, bool tls_13)
 	{
 		const unsigned char *sequence = tls_13 ? aad + 5 : aad;
 		if(tls_13)
 			aad_size = 5;
 
 		int counter = 1;
-		out.append_size(packet_size+POLY1305_TAGLEN);
 		unsigned char poly1305_key[POLY1305_KEYLEN];
 		chacha_ivupdate(&chacha_local, local_nonce, sequence, (u8 *)&counter);
 		chacha20_poly1305_key(&chacha_local, poly1305_key);
-		chacha20_poly1305_aead(&chacha_local, (u8*)packet, packet_size, (u8*)aad, aad_size, poly1305_key, (u8*)out.buf + out.size-POLY1305_TAGLEN-packet_size);
+		chacha20_poly1305_aead(&chacha_local, body, packet_size, (u8*)aad, aad_size, poly1305_key, body);
 
 	}
 
 	
-	char *decode(tlsbuf_reader &in, tlsbuf &out, const unsigned char *aad, int aad_size, bool tls_13)
+	char *decode(tlsbuf_reader &in, const unsigned char *aad, int aad_size, bool tls_13)
 	{
-		out.check_size(in.buf_size);
-
 		const unsigned char *sequence = tls_13 ? aad + 5 : aad;
 		if(tls_13)
 			aad_size = 5;
@@ -288,10 +354,10 @@ public:
 		chacha_ivupdate(&chacha_remote, remote_nonce, (u8*)sequence, (unsigned char *)&counter);
 		unsigned char poly1305_key[POLY1305_KEYLEN];
 		chacha20_poly1305_key(&chacha_remote, poly1305_key);
-		int size = chacha20_poly1305_decode(&chacha_remote, (u8*)in.buf, in.buf_size, (u8*)aad, aad_size, poly1305_key, (u8*)out.buf);
-		if(size <= 0)
+		int size = chacha20_poly1305_decode(&chacha_remote, (u8*)in.buf, in.buf_size, (u8*)aad, aad_size, poly1305_key, (u8*)in.buf);
+		if(size < 0)
 			return "Êý¾ÝÐ£ÑéÊ§°Ü";
-		out.size = size;
+		in.buf_size = size;
 		return 0;
 	}
 	virtual int compute_size(int size, int encode_or_decode, bool tls_13)
@@ -309,35 +375,50 @@ static tls_encoder *create_encoder_chacha20()
 }
 
 
+// Running handshake transcript hash. Until the cipher suite is known both
+// SHA-256 and SHA-384 are fed; select() then drops the one not needed.
+// get_hash() finalizes a copy, so intermediate hashes cost nothing extra,
+// and copying a tls_hash is a cheap snapshot of the transcript so far.
 class tls_hash
 {
-	tlsbuf	cache;
+	sha256_ctx	ctx256;
+	sha384_ctx	ctx384;
+	int			hash_size;	// 0 while both are running
 public:
+	tls_hash()
+	{
+		reset();
+	}
 	void reset()
 	{
-		cache.clear();
+		sha256_init(&ctx256);
+		sha384_init(&ctx384);
+		hash_size = 0;
+	}
+	void select(int size)
+	{
+		hash_size = size;
 	}
 	void append(const char *buf, int size)
 	{
-		cache.append(buf, size);
+		if(size <= 0)
+			return;
+		if(hash_size != 48)
+			sha256_update(&ctx256, (u8*)buf, size);
+		if(hash_size != 32)
+			sha384_update(&ctx384, (u8*)buf, size);
 	}
 
-	void get_hash(const char *out, int hash_size)
+	void get_hash(const char *out, int hash_size) const
 	{
 		if(hash_size == 32)
 		{
-			sha256_ctx ctx;
-			sha256_init(&ctx);
-			if(cache.size > 0)
-				sha256_update(&ctx, (u8*)cache.buf, cache.size);
+			sha256_ctx ctx = ctx256;
 			sha256_final(&ctx, (u8*)out);
 		}
 		else
 		{
-			sha384_ctx ctx;
-			sha384_init(&ctx);
-			if(cache.size > 0)
-				sha384_update(&ctx, (u8*)cache.buf, cache.size);
+			sha384_ctx ctx = ctx384;
 			sha384_final(&ctx, (u8*)out);
 		}
 	}
@@ -374,6 +455,318 @@ public:
 		else
 			hmac_sha384_final(&ctx384, mac, mac_size);
 	}
+	// back to the keyed state without redoing the ipad/opad setup
+	void reinit()
+	{
+		if(hash_size == 32)
+			hmac_sha256_reinit(&ctx256);
+		else
+			hmac_sha384_reinit(&ctx384);
+	}
+};
+
+// HKDF-Expand and the TLS 1.2 PRF keyed by one secret. The HMAC key
+// schedule is computed once in the constructor and every output block
+// starts from it, so derive as many labels from one object as needed.
+class tls_kdf
+{
+	tls_hmac		hmac;
+	unsigned int	hash_len;
+public:
+	tls_kdf(int hash_len, const unsigned char *secret, unsigned int secret_len) : hmac(hash_len, secret, secret_len)
+	{
+		this->hash_len = hash_len;
+	}
+
+	void expand(unsigned char *output, unsigned int outlen, const unsigned char *info, unsigned char info_len)
+	{
+		unsigned char	digest_out[MAX_HASH_LEN];
+		unsigned char	i2 = 0;
+		while (outlen) {
+			hmac.reinit();
+			if (i2)
+				hmac.update(digest_out, hash_len);
+			if ((info) && (info_len))
+				hmac.update(info, info_len);
+			i2++;
+			hmac.update(&i2, 1);
+			hmac.done(digest_out, hash_len);
+
+			unsigned int copylen = outlen < hash_len ? outlen : hash_len;
+			memcpy(output, digest_out, copylen);
+			output += copylen;
+			outlen -= copylen;
+		}
+	}
+
+	void prf(char *output, unsigned int outlen, const char *label, unsigned int label_len, const char *seed, unsigned int seed_len,
+			 const unsigned char *seed_b, unsigned int seed_b_len)
+	{
+		unsigned char digest_out0[MAX_HASH_LEN];
+		unsigned char digest_out1[MAX_HASH_LEN];
+
+		hmac.reinit();
+		hmac.update((u8*)label, label_len);
+		hmac.update((u8*)seed, seed_len);
+		if ((seed_b) && (seed_b_len))
+			hmac.update(seed_b, seed_b_len);
+		hmac.done(digest_out0, hash_len);
+		while (outlen) {
+			hmac.reinit();
+			hmac.update(digest_out0, hash_len);
+			hmac.update((u8*)label, label_len);
+			hmac.update((u8*)seed, seed_len);
+			if ((seed_b) && (seed_b_len))
+				hmac.update(seed_b, seed_b_len);
+			hmac.done(digest_out1, hash_len);
+
+			unsigned int copylen = outlen < hash_len ? outlen : hash_len;
+			memcpy(output, digest_out1, copylen);
+			output += copylen;
+			outlen -= copylen;
+			if (!outlen)
+				break;
+
+			hmac.reinit();
+			hmac.update(digest_out0, hash_len);
+			hmac.done(digest_out0, hash_len);
+		}
+	}
+};
+
+
+// Ephemeral key pair for one group of tls_cipher::ecc_list(): the P-curves
+// from ecc.c or X25519 from curve25519.c.
+class tls_ecc_key
+{
+	ECC_GROUP	group;
+	union
+	{
+		EccState	ecc;
+		struct
+		{
+			u8 privatekey[32], publickey[32];
+		} x25519;
+	};
+public:
+	~tls_ecc_key()
+	{
+		volatile u8 *p = (volatile u8*)&ecc;
+		for(int i = 0; i < (int)max(sizeof(ecc), sizeof(x25519)); i++)
+			p[i] = 0;
+	}
+
+	int init(ECC_GROUP group, int size)
+	{
+		this->group = group;
+		if(group == ECC_x25519)
+		{
+			if(!getRandomBytes(x25519.privatekey, sizeof(x25519.privatekey)))
+				return -1;
+			curve25519(x25519.publickey, x25519.privatekey, 0);
+			return 0;
+		}
+		return ecc_init(&ecc, size);
+	}
+
+	int export_public_key(u8 *out, int size)
+	{
+		if(group == ECC_x25519)
+		{
+			if(out == 0 || size < (int)sizeof(x25519.publickey))
+				return 0;
+			memcpy(out, x25519.publickey, sizeof(x25519.publickey));
+			return sizeof(x25519.publickey);
+		}
+		return ecc_export_public_key(&ecc, out, size);
+	}
+
+	int shared_secret(const u8 *server_key, int server_key_len, u8 *secret)
+	{
+		if(group == ECC_x25519)
+		{
+			if(server_key_len != sizeof(x25519.publickey))
+				return -1;
+			curve25519(secret, x25519.privatekey, server_key);
+			// RFC 7748 6.1: a small-order peer key gives all zeros
+			u8 any = 0;
+			for(int i = 0; i < 32; i++)
+				any |= secret[i];
+			return any ? 0 : -1;
+		}
+		return ecdh_shared_secret(&ecc, server_key, server_key_len, secret);
+	}
+};
+
+
+struct tls_key_pool_stats
+{
+	int			depth;		// keys kept ready per group, 0 when the pool is off
+	unsigned	hits;		// handshakes that got a ready key
+	unsigned	misses;		// handshakes that had to generate one inline
+	unsigned	generated;	// keys made by the pool thread
+};
+
+// Process-wide pool of ephemeral keys, generated ahead of time on a
+// low-priority thread so ClientHello does not wait for key generation.
+// Each key is handed out once and then belongs to the taker.
+class tls_key_pool
+{
+	struct slot
+	{
+		ECC_GROUP					group;
+		int							size;
+		std::vector<tls_ecc_key*>	keys;
+	};
+	static const int	max_slots = 8;
+
+	CLockData		lockdata;
+	CLockData		control;		// start() and stop(); never taken by the refill thread
+	slot			slots[max_slots];
+	int				slot_count;
+	int				depth;
+	unsigned		hits, misses, generated;
+	volatile LONG	running;
+	HANDLE			thread, wake;
+
+	static DWORD WINAPI refill_proc(LPVOID param)
+	{
+		tls_key_pool *pool = (tls_key_pool*)param;
+		while(pool->running)
+		{
+			bool idle = true;
+			for(int i = 0; i < pool->slot_count && pool->running; i++)
+			{
+				slot &sl = pool->slots[i];
+				{
+					CLock lock(pool->lockdata);
+					if((int)sl.keys.size() >= pool->depth)
+						continue;
+				}
+				tls_ecc_key *key = new tls_ecc_key;
+				if(key->init(sl.group, sl.size) != 0)
+				{
+					delete key;
+					continue;
+				}
+				CLock lock(pool->lockdata);
+				sl.keys.push_back(key);
+				pool->generated++;
+				idle = false;
+			}
+			// sleep until a key is taken; retry now and then if keygen failed
+			if(idle)
+				WaitForSingleObject(pool->wake, 1000);
+		}
+		return 0;
+	}
+
+	tls_key_pool()
+	{
+		slot_count	= 0;
+		depth		= 0;
+		hits		= misses = generated = 0;
+		running		= 0;
+		thread		= 0;
+		wake		= CreateEvent(0, FALSE, FALSE, 0);
+	}
+	~tls_key_pool()
+	{
+		stop();
+		CloseHandle(wake);
+	}
+public:
+	static tls_key_pool &get()
+	{
+		static tls_key_pool pool;
+		return pool;
+	}
+
+	void add_group(ECC_GROUP group, int size)
+	{
+		CLock lock(lockdata);
+		for(int i = 0; i < slot_count; i++)
+			if(slots[i].group == group)
+				return;
+		if(slot_count >= max_slots)
+			return;
+		slots[slot_count].group	= group;
+		slots[slot_count].size	= size;
+		slot_count++;
+	}
+
+	void start(int depth)
+	{
+		CLock control_lock(control);
+		{
+			CLock lock(lockdata);
+			this->depth = depth;
+		}
+		if(running)
+		{
+			SetEvent(wake);
+			return;
+		}
+		running = 1;
+		thread = CreateThread(0, 0, refill_proc, this, 0, 0);
+		if(thread == 0)
+		{
+			running = 0;
+			return;
+		}
+		SetThreadPriority(thread, THREAD_PRIORITY_LOWEST);
+	}
+
+	void stop()
+	{
+		CLock control_lock(control);
+		if(running)
+		{
+			running = 0;
+			SetEvent(wake);
+			WaitForSingleObject(thread, INFINITE);
+			CloseHandle(thread);
+			thread = 0;
+		}
+		CLock lock(lockdata);
+		depth = 0;
+		for(int i = 0; i < slot_count; i++)
+		{
+			for(size_t j = 0; j < slots[i].keys.size(); j++)
+				delete slots[i].keys[j];
+			slots[i].keys.clear();
+		}
+	}
+
+	// A ready key for this group, or 0 when the pool is off or empty.
+	tls_ecc_key *take(ECC_GROUP group)
+	{
+		tls_ecc_key *key = 0;
+		{
+			CLock lock(lockdata);
+			if(depth <= 0)
+				return 0;
+			for(int i = 0; i < slot_count; i++)
+				if(slots[i].group == group && slots[i].keys.size() > 0)
+				{
+					key = slots[i].keys.back();
+					slots[i].keys.pop_back();
+				}
+			if(key)
+				hits++;
+			else
+				misses++;
+		}
+		SetEvent(wake);
+		return key;
+	}
+
+	tls_key_pool_stats stats()
+	{
+		CLock lock(lockdata);
+		tls_key_pool_stats st = {depth, hits, misses, generated};
+		return st;
+	}
 };
 
 
@@ -405,84 +798,27 @@ class tls_cipher
 	}
 
 	void _private_tls_hkdf_expand(unsigned char *output, unsigned int outlen, const unsigned char *secret, unsigned int secret_len, const unsigned char *info, unsigned char info_len) {
-		unsigned char	digest_out[MAX_HASH_LEN];
-		unsigned int	idx = 0;
-		unsigned char	i2 = 0;
-		unsigned int	hash_len = chiper_list()[cipher_index].hash_len;
-		while (outlen) {
-			tls_hmac hmac(hash_len, secret, secret_len);
-			if (i2)
-				hmac.update(digest_out, hash_len);
-			if ((info) && (info_len))
-				hmac.update(info, info_len);
-			i2++;
-			hmac.update(&i2, 1);
-			hmac.done(digest_out, hash_len);
-            
-			unsigned int copylen = outlen;
-			if (copylen > hash_len)
-				copylen = (unsigned int)hash_len;
-            
-			for (unsigned int i = 0; i < copylen; i++) {
-				output[idx++] = digest_out[i];
-				outlen--;
-			}
-            
-			if (!outlen)
-				break;            
-		}
+		tls_kdf kdf(chiper_list()[cipher_index].hash_len, secret, secret_len);
+		kdf.expand(output, outlen, info, info_len);
 	}
 
-	void _private_tls_hkdf_expand_label(unsigned char *output, unsigned int outlen, const unsigned char *secret, unsigned int secret_len, const char *label, unsigned char label_len, const unsigned char *data, unsigned char data_len) {
+	void _private_tls_hkdf_expand_label(unsigned char *output, unsigned int outlen, tls_kdf &kdf, const char *label, unsigned char label_len, const unsigned char *data, unsigned char data_len) {
 		unsigned char hkdf_label[512];
 		int len = _private_tls_hkdf_label(label, label_len, data, data_len, hkdf_label, outlen);
-		_private_tls_hkdf_expand(output, outlen, secret, secret_len, hkdf_label, len);
+		kdf.expand(output, outlen, hkdf_label, len);
+	}
+
+	void _private_tls_hkdf_expand_label(unsigned char *output, unsigned int outlen, const unsigned char *secret, unsigned int secret_len, const char *label, unsigned char label_len, const unsigned char *data, unsigned char data_len) {
+		tls_kdf kdf(chiper_list()[cipher_index].hash_len, secret, secret_len);
+		_private_tls_hkdf_expand_label(output, outlen, kdf, label, label_len, data, data_len);
 	}
 
 	void _private_tls_prf(char *output, unsigned int outlen, const char *secret, const unsigned int secret_len,
 						   const char *label, unsigned int label_len, char *seed, unsigned int seed_len,
 						   unsigned char *seed_b, unsigned int seed_b_len)
 	{
-		{
-			// sha256_hmac
-			unsigned char digest_out0[MAX_HASH_LEN];
-			unsigned char digest_out1[MAX_HASH_LEN];
-			unsigned int i;
-        
-			unsigned int hash_len = chiper_list()[cipher_index].hash_len;
-			tls_hmac hmac(hash_len, (u8*)secret, secret_len);
-			hmac.update( (unsigned char*)label, label_len);
-			hmac.update((unsigned char*)seed, seed_len);
-			if ((seed_b) && (seed_b_len))
-				hmac.update((unsigned char*)seed_b, seed_b_len);
-			hmac.done(digest_out0, hash_len);
-			int idx = 0;
-			while (outlen) {
-				tls_hmac hmac(hash_len, (u8*)secret, secret_len);
-				hmac.update( digest_out0, hash_len);
-				hmac.update( (u8*)label, label_len);
-				hmac.update((u8*)seed, seed_len);
-				if ((seed_b) && (seed_b_len))
-					hmac.update(seed_b, seed_b_len);
-				hmac.done(digest_out1, hash_len);
-            
-				unsigned int copylen = outlen;
-				if (copylen > hash_len)
-					copylen = (unsigned int)hash_len;
-            
-				for (i = 0; i < copylen; i++) {
-					output[idx++] = digest_out1[i];
-					outlen--;
-				}
-            
-				if (!outlen)
-					break;
-            
-				tls_hmac hmac2(hash_len, (u8*)secret, secret_len);
-				hmac2.update(digest_out0, hash_len);
-				hmac2.done(digest_out0, hash_len);
-			}
-		}
+		tls_kdf kdf(chiper_list()[cipher_index].hash_len, (u8*)secret, secret_len);
+		kdf.prf(output, outlen, label, label_len, seed, seed_len, seed_b, seed_b_len);
 	}
 public:
 	struct chiper_interface
@@ -498,11 +834,15 @@ public:
 		ECC_GROUP iana;
 	};
 
-	static int const ecc_count = 2;
-	const ECCCurveParameters *ecc_list()
+	static int const ecc_count = 3;
+	static const ECCCurveParameters *ecc_list()
 	{
 		static ECCCurveParameters ecc[] = 
 		{
+			{
+				32,
+				ECC_x25519,
+			},
 			{
 				32,
 				ECC_secp256r1,
@@ -533,30 +873,39 @@ public:
 	
 
 private:
-	tlsbuf				pub_key, decode_buf;
+	tlsbuf				pub_key;
+	tlsbuf				pre_master;		// TLS 1.2, until the ClientKeyExchange is sent
 	int					client_sequence_number,
 						server_sequence_number;
 	union 
 	{
 		struct {
-			u8 secret[MAX_HASH_LEN], hs_secret[MAX_HASH_LEN], prk[MAX_HASH_LEN];
+			u8 secret[MAX_HASH_LEN], hs_secret[MAX_HASH_LEN], prk[MAX_HASH_LEN], res_secret[MAX_HASH_LEN];
 		} data13;
 		struct {
 			u8 client_rand[RAND_SIZE], server_rand[RAND_SIZE], master_key[48];
 		} data12;
 	};
 
-	EccState	*pri_ecc_key[ecc_count];
+	tls_ecc_key	*pri_ecc_key[ecc_count];
 	
 	tls_hash	hash;
+	tls_hash	hello_hash;		// transcript after the first ClientHello
+	u8			psk[MAX_HASH_LEN];	// resumption PSK the server accepted
+	int			psk_len;
+	u8			early_key[MAX_KEY_SIZE], early_iv[MAX_IV_SIZE];	// client_early_traffic_secret
+	int			early_sequence_number;
 	int			cipher_index;
 	tls_encoder *encoder;
-	bool		encoding;
+	bool		encoding;		// records we send are protected
+	bool		decoding;		// records we receive are
+	int			ghash_mode;
 //	CLockData	lockdata;
 public:
 	tls_cipher()
 	{
 		encoder			= 0;
+		ghash_mode		= GCM_GHASH_AUTO;
 		memset(pri_ecc_key, 0, sizeof(pri_ecc_key));
 		reset();
 	}
@@ -569,12 +918,22 @@ public:
 	{
 	//	CLock lock(lockdata);
 		pub_key.clear();
+		if(pre_master.size > 0)
+			memset(pre_master.buf, 0, pre_master.size);
+		pre_master.clear();
 		memset(&data12, 0, max(sizeof(data12), sizeof(data13)));
 		client_sequence_number = 0;
 		server_sequence_number = 0;
 		hash.reset();
+		hello_hash.reset();
+		memset(psk, 0, sizeof(psk));
+		psk_len		= 0;
+		memset(early_key, 0, sizeof(early_key));
+		memset(early_iv, 0, sizeof(early_iv));
+		early_sequence_number = 0;
 		cipher_index= -1;
 		encoding	= false;
+		decoding	= false;
 		if(encoder)
 			delete encoder;
 		encoder = 0;
@@ -591,6 +950,10 @@ public:
 			data12.client_rand[i] = rand()&0xff;
 		return data12.client_rand;
 	}
+	BYTE *get_client_rand()
+	{
+		return data12.client_rand;
+	}
 	char *update_server_info(int cipher, const void *rand, bool tls_13)
 	{
 		cipher_index = -1;
@@ -599,12 +962,20 @@ public:
 				cipher_index = i;
 		if(cipher_index == -1)
 			return "Ã»ÓÐ¶ÔÓ¦µÄ½âÂëÌ×¼þ";
+		if(encoder)
+			delete encoder;
 		encoder = chiper_list()[cipher_index].encoder_create();
+		encoder->set_ghash(ghash_mode);
+		hash.select(chiper_list()[cipher_index].hash_len);
 		if(tls_13 == false)
 			memcpy(data12.server_rand, rand, RAND_SIZE);
 		return 0;
 
 	}
+	void set_ghash_mode(int mode)
+	{
+		ghash_mode = mode;
+	}
 	void get_hash(const char *out)
 	{
 	//	CLock lock(lockdata);
@@ -621,22 +992,152 @@ public:
 			return 32;
 		return chiper_list()[cipher_index].hash_len;
 	}
+	void save_hello_hash()
+	{
+		hello_hash = hash;
+	}
+	// RFC 8446 4.4.1: after a HelloRetryRequest the transcript restarts with
+	// message_hash(Hash(ClientHello1)) followed by the HelloRetryRequest
+	void retry_hash(const char *hello_retry, int len)
+	{
+		int  hash_len = get_hash_size();
+		char msg[4 + MAX_HASH_LEN];
+		msg[0] = MSG_MESSAGE_HASH;
+		msg[1] = 0;
+		msg[2] = 0;
+		msg[3] = (char)hash_len;
+		hello_hash.get_hash(msg + 4, hash_len);
+		hash.reset();
+		hash.select(hash_len);
+		hash.append(msg, 4 + hash_len);
+		hash.append(hello_retry, len);
+	}
+
+	// RFC 8446 4.2.11.2: binder of a PSK whose hash is hash_len, over the
+	// transcript so far plus the ClientHello truncated before its binders.
+	// The cipher suite is not known yet, so nothing here uses cipher_index.
+	void compute_binder(u8 *out, const u8 *psk, int hash_len, const char *partial_hello, int partial_len)
+	{
+		u8 zeros[MAX_HASH_LEN], early[MAX_HASH_LEN], empty_hash[MAX_HASH_LEN];
+		u8 binder_key[MAX_HASH_LEN], finished_key[MAX_HASH_LEN], transcript[MAX_HASH_LEN];
+		memset(zeros, 0, sizeof(zeros));
+		tls_hmac extract(hash_len, zeros, hash_len);
+		extract.update(psk, hash_len);
+		extract.done(early, hash_len);
+
+		tls_hash empty;
+		empty.get_hash((char*)empty_hash, hash_len);
+		tls_kdf early_kdf(hash_len, early, hash_len);
+		_private_tls_hkdf_expand_label(binder_key, hash_len, early_kdf, "res binder", 10, empty_hash, hash_len);
+		tls_kdf binder_kdf(hash_len, binder_key, hash_len);
+		_private_tls_hkdf_expand_label(finished_key, hash_len, binder_kdf, "finished", 8, NULL, 0);
+
+		tls_hash partial = hash;
+		partial.append(partial_hello, partial_len);
+		partial.get_hash((char*)transcript, hash_len);
+		tls_hmac hmac(hash_len, finished_key, hash_len);
+		hmac.update(transcript, hash_len);
+		hmac.done(out, hash_len);
+	}
+	// the PSK the server accepted feeds the early secret of tls13_compute_key
+	void set_psk(const u8 *key, int len)
+	{
+		memcpy(psk, key, len);
+		psk_len = len;
+	}
+
+	// 0-RTT: encrypt with client_early_traffic_secret of the offered ticket
+	// right after the ClientHello. The transcript keeps both hashes running,
+	// the ServerHello may still pick another suite.
+	const char *tls13_early_key(TLS_CIPHER cipher, const u8 *ticket_psk, int ticket_psk_len)
+	{
+		cipher_index = -1;
+		for(int i = 0; i < chiper_count; i++)
+			if(chiper_list()[i].cipher == cipher)
+				cipher_index = i;
+		if(cipher_index == -1 || chiper_list()[cipher_index].hash_len != ticket_psk_len)
+			return "Ã»ÓÐ¶ÔÓ¦µÄ½âÂëÌ×¼þ";
+		if(encoder)
+			delete encoder;
+		encoder = chiper_list()[cipher_index].encoder_create();
+		encoder->set_ghash(ghash_mode);
+
+		int key_len		= chiper_list()[cipher_index].key_len;
+		int hash_len	= ticket_psk_len;
+		u8	zeros[MAX_HASH_LEN], early[MAX_HASH_LEN], hello[MAX_HASH_LEN], secret[MAX_HASH_LEN];
+		memset(zeros, 0, sizeof(zeros));
+		tls_hmac extract(hash_len, zeros, hash_len);
+		extract.update(ticket_psk, hash_len);
+		extract.done(early, hash_len);
+		hash.get_hash((char*)hello, hash_len);
+
+		tls_kdf early_kdf(hash_len, early, hash_len);
+		_private_tls_hkdf_expand_label(secret, hash_len, early_kdf, "c e traffic", 11, hello, hash_len);
+		tls_kdf local(hash_len, secret, hash_len);
+		_private_tls_hkdf_expand_label(early_key, key_len, local, "key", 3, NULL, 0);
+		_private_tls_hkdf_expand_label(early_iv, encoder->iv_len(true), local, "iv", 2, NULL, 0);
+
+		client_sequence_number = 0;
+		if(encoder->init(early_key, early_key, early_iv, early_iv, key_len, true) == false)
+			return "³õÊ¼»¯cipherÊ§°Ü";
+		return 0;
+	}
+	// EndOfEarlyData still goes out under the early keys, everything after
+	// it under the client handshake keys; the server side stays as it is
+	const char *tls13_early_sending(bool early)
+	{
+		if(cipher_index == -1)
+			return "compute_key error:Ã»ÓÐ¶ÔÓ¦µÄ½âÂëÌ×¼þ";
+		int key_len		= chiper_list()[cipher_index].key_len;
+		int hash_len	= chiper_list()[cipher_index].hash_len;
+		u8	local_key[MAX_KEY_SIZE], remote_key[MAX_KEY_SIZE], local_iv[MAX_IV_SIZE], remote_iv[MAX_IV_SIZE];
+
+		tls_kdf remote(hash_len, data13.secret, hash_len);
+		_private_tls_hkdf_expand_label(remote_key, key_len, remote, "key", 3, NULL, 0);
+		_private_tls_hkdf_expand_label(remote_iv, encoder->iv_len(true), remote, "iv", 2, NULL, 0);
+		if(early)
+		{
+			memcpy(local_key, early_key, key_len);
+			memcpy(local_iv, early_iv, encoder->iv_len(true));
+			client_sequence_number = early_sequence_number;
+		}
+		else
+		{
+			tls_kdf local(hash_len, data13.hs_secret, hash_len);
+			_private_tls_hkdf_expand_label(local_key, key_len, local, "key", 3, NULL, 0);
+			_private_tls_hkdf_expand_label(local_iv, encoder->iv_len(true), local, "iv", 2, NULL, 0);
+			client_sequence_number = 0;
+		}
+		if(encoder->init(local_key, remote_key, local_iv, remote_iv, key_len, true) == false)
+			return "³õÊ¼»¯cipherÊ§°Ü";
+		return 0;
+	}
+
+	int get_ecc_index(ECC_GROUP ecc)
+	{
+		for(int i = 0; i < ecc_count; i++)
+			if(ecc_list()[i].iana == ecc)
+				return i;
+		return -1;
+	}
 
 	const char *compute_pubkey(int ecc_index, tlsbuf &out)
 	{
 	//	CLock lock(lockdata);
 
+		if(pri_ecc_key[ecc_index] == 0)
+			pri_ecc_key[ecc_index] = tls_key_pool::get().take(ecc_list()[ecc_index].iana);
 		if(pri_ecc_key[ecc_index] == 0)
 		{
-			pri_ecc_key[ecc_index] = new EccState;
-			if(ecc_init(pri_ecc_key[ecc_index], ecc_list()[ecc_index].size) != 0)
+			pri_ecc_key[ecc_index] = new tls_ecc_key;
+			if(pri_ecc_key[ecc_index]->init(ecc_list()[ecc_index].iana, ecc_list()[ecc_index].size) != 0)
 				return "³õÊ¼»¯ecc keyÊ§°Ü";
 		}
 
 		int size = MAX_PUBKEY_SIZE;
 		out.check_size(MAX_PUBKEY_SIZE);
 
-		out.size  += ecc_export_public_key(pri_ecc_key[ecc_index], (u8*)out.buf+out.size, MAX_PUBKEY_SIZE);
+		out.size  += pri_ecc_key[ecc_index]->export_public_key((u8*)out.buf+out.size, MAX_PUBKEY_SIZE);
 
 		return 0;
 	}
@@ -645,13 +1146,8 @@ public:
 private: 
 	const char *compute_pre_key(ECC_GROUP ecc, const char *_server_key, int server_key_len, tlsbuf &premaster_key)
 	{
-		const ECCCurveParameters *cur_ecc = 0;
-		int ecc_index;
-		for(ecc_index = 0; ecc_index < ecc_count && cur_ecc == 0; ecc_index++)
-			if(ecc == ecc_list()[ecc_index].iana)
-				cur_ecc = &ecc_list()[ecc_index];
-		ecc_index--;
-		if(ecc_index >= ecc_count || cur_ecc == 0)
+		int ecc_index = get_ecc_index(ecc);
+		if(ecc_index < 0)
 			return "Ã»ÕÒµ½¶ÔÓ¦µÄecc ²ÎÊý";
 		const char *ret = 0;
 		if(ret = compute_pubkey(ecc_index, pub_key))
@@ -659,7 +1155,7 @@ private:
 
 		premaster_key.set_size(ecc_list()[ecc_index].size);
 
-		if(ecdh_shared_secret(pri_ecc_key[ecc_index], (u8*)_server_key, server_key_len, (u8*)premaster_key.buf) != 0)
+		if(pri_ecc_key[ecc_index]->shared_secret((u8*)_server_key, server_key_len, (u8*)premaster_key.buf) != 0)
 			return "ecc¼ÆËãpre master keyÊ§°Ü";
 
 		return 0;
@@ -671,16 +1167,52 @@ public:
 			return "compute_key error:Ã»ÓÐ¶ÔÓ¦µÄ½âÂëÌ×¼þ";
 	//	CLock lock(lockdata);
 
-		tlsbuf premaster_key;
-		const char *ret = compute_pre_key(ecc, _server_key, server_key_len, premaster_key);
-		if(ret)
-			return ret;
-		
-		int key_len = chiper_list()[cipher_index].key_len;
+		return compute_pre_key(ecc, _server_key, server_key_len, pre_master);
+	}
+
+	// master secret and keys once the ClientKeyExchange is in the transcript.
+	// RFC 7627: the extended master secret uses the session hash instead of the randoms
+	const char *tls12_master_secret(bool extended)
+	{
+		if(cipher_index == -1 || pre_master.size == 0)
+			return "compute_key error:Ã»ÓÐ¶ÔÓ¦µÄ½âÂëÌ×¼þ";
+
 		//----Ö÷ÃÜÔ¿¼ÆËã
-		char master_secret_label[] = "master secret", key_expansion[] = "key expansion";
-		_private_tls_prf((char*)data12.master_key, sizeof(data12.master_key), premaster_key.buf, premaster_key.size, master_secret_label, strlen(master_secret_label), (char*)data12.client_rand, RAND_SIZE, data12.server_rand, RAND_SIZE);
-	
+		if(extended)
+		{
+			char session_hash[MAX_HASH_LEN];
+			char master_secret_label[] = "extended master secret";
+			get_hash(session_hash);
+			_private_tls_prf((char*)data12.master_key, sizeof(data12.master_key), pre_master.buf, pre_master.size, master_secret_label, strlen(master_secret_label), session_hash, get_hash_size(), NULL, 0);
+		}
+		else
+		{
+			char master_secret_label[] = "master secret";
+			_private_tls_prf((char*)data12.master_key, sizeof(data12.master_key), pre_master.buf, pre_master.size, master_secret_label, strlen(master_secret_label), (char*)data12.client_rand, RAND_SIZE, data12.server_rand, RAND_SIZE);
+		}
+		memset(pre_master.buf, 0, pre_master.size);
+		pre_master.clear();
+		return tls12_key_block();
+	}
+
+	// abbreviated handshake: the cached master secret with the new randoms
+	const char *tls12_resume_key(const u8 *master_key)
+	{
+		if(cipher_index == -1)
+			return "compute_key error:Ã»ÓÐ¶ÔÓ¦µÄ½âÂëÌ×¼þ";
+		memcpy(data12.master_key, master_key, sizeof(data12.master_key));
+		return tls12_key_block();
+	}
+	const u8 *tls12_master_key()
+	{
+		return data12.master_key;
+	}
+
+private:
+	const char *tls12_key_block()
+	{
+		int key_len = chiper_list()[cipher_index].key_len;
+		char key_expansion[] = "key expansion";
 		unsigned char key[192];	//Ò»¸ö±È½Ï´óµÄÊý×é
 		_private_tls_prf((char*)key, sizeof(key), (char*)data12.master_key, sizeof(data12.master_key), key_expansion, strlen(key_expansion), (char*)data12.server_rand, RAND_SIZE, data12.client_rand, RAND_SIZE);
 		
@@ -688,6 +1220,7 @@ public:
 			return "³õÊ¼»¯cipherÊ§°Ü";
 		return 0;
 	}
+public:
 
 	const char *tls13_compute_key(ECC_GROUP ecc, const char *_server_key, int server_key_len, const char *finished_hash)
 	{
@@ -702,8 +1235,8 @@ public:
 		u8 earlysecret[MAX_HASH_LEN], salt[MAX_HASH_LEN];
 		u8 local_keybuffer[MAX_KEY_SIZE], remote_keybuffer[MAX_KEY_SIZE];
 		u8 local_ivbuffer[MAX_IV_SIZE], remote_ivbuffer[MAX_IV_SIZE];
-		const char *server_key = ecc == ECC_NONE ? "s ap traffic" : "s hs traffic";
-		const char *client_key = ecc == ECC_NONE ? "c ap traffic" : "c hs traffic";
+		const char *server_key = finished_hash ? "s ap traffic" : "s hs traffic";
+		const char *client_key = finished_hash ? "c ap traffic" : "c hs traffic";
 		tls_hash hash2;
 		hash2.get_hash((char*)hash, hash_len);
 		memset(earlysecret, 0, sizeof(earlysecret));
@@ -711,36 +1244,48 @@ public:
 
 
 		
-		if(ecc == ECC_NONE)
+		if(finished_hash)
 		{
 			_private_tls_hkdf_expand_label(salt, hash_len, (u8*)data13.prk, hash_len, "derived", 7, hash, hash_len);
 			_private_tls_hkdf_extract(data13.prk, hash_len, salt, hash_len, earlysecret, hash_len);
-
-			if(finished_hash)
-				memcpy(hash, finished_hash, hash_len);
+			memcpy(hash, finished_hash, hash_len);
 		}
 		else
 		{
+			// ECC_NONE is psk_ke: no (EC)DHE, the shared secret is all zeros
 			tlsbuf premaster_key;
-			const char *ret = compute_pre_key(ecc, _server_key, server_key_len, premaster_key);
-			if(ret)
-				return ret;
-			_private_tls_hkdf_extract(data13.prk, hash_len, NULL, 0, earlysecret, hash_len);
+			if(ecc != ECC_NONE)
+			{
+				const char *ret = compute_pre_key(ecc, _server_key, server_key_len, premaster_key);
+				if(ret)
+					return ret;
+			}
+			else
+			{
+				premaster_key.set_size(hash_len);
+				memset(premaster_key.buf, 0, hash_len);
+			}
+			_private_tls_hkdf_extract(data13.prk, hash_len, NULL, 0, psk_len == hash_len ? psk : earlysecret, hash_len);
 			_private_tls_hkdf_expand_label(salt, hash_len, data13.prk, hash_len, "derived", 7, hash, hash_len);
 			_private_tls_hkdf_extract(data13.prk, hash_len, salt, hash_len, (u8*)premaster_key.buf, premaster_key.size);
 
 			get_hash((char*)hash);
+			// records sent as early data numbered the client side already
+			early_sequence_number = client_sequence_number;
+			reset_sequence_number();
 		}
 		
-		_private_tls_hkdf_expand_label(data13.hs_secret, hash_len, data13.prk, hash_len, client_key, strlen(client_key), hash, hash_len);
-		
-		_private_tls_hkdf_expand_label(local_keybuffer, key_len, data13.hs_secret, hash_len, "key", 3, NULL, 0);
-		_private_tls_hkdf_expand_label(local_ivbuffer, encoder->iv_len(true), data13.hs_secret, hash_len, "iv", 2, NULL, 0);
+		tls_kdf prk(hash_len, data13.prk, hash_len);
+		_private_tls_hkdf_expand_label(data13.hs_secret, hash_len, prk, client_key, strlen(client_key), hash, hash_len);
+		_private_tls_hkdf_expand_label(data13.secret, hash_len, prk, server_key, strlen(server_key), hash, hash_len);
 
-		_private_tls_hkdf_expand_label(data13.secret, hash_len, data13.prk, hash_len, server_key, strlen(server_key), hash, hash_len);
-		
-		_private_tls_hkdf_expand_label(remote_keybuffer, key_len, data13.secret, hash_len, "key", 3, NULL, 0);
-		_private_tls_hkdf_expand_label(remote_ivbuffer, encoder->iv_len(true), data13.secret, hash_len, "iv", 2, NULL, 0);
+		tls_kdf local(hash_len, data13.hs_secret, hash_len);
+		_private_tls_hkdf_expand_label(local_keybuffer, key_len, local, "key", 3, NULL, 0);
+		_private_tls_hkdf_expand_label(local_ivbuffer, encoder->iv_len(true), local, "iv", 2, NULL, 0);
+
+		tls_kdf remote(hash_len, data13.secret, hash_len);
+		_private_tls_hkdf_expand_label(remote_keybuffer, key_len, remote, "key", 3, NULL, 0);
+		_private_tls_hkdf_expand_label(remote_ivbuffer, encoder->iv_len(true), remote, "iv", 2, NULL, 0);
 
 		
 		if(encoder->init(local_keybuffer, remote_keybuffer, local_ivbuffer, remote_ivbuffer, key_len, true) == false)
@@ -749,6 +1294,26 @@ public:
 		return 0;
 	}
 
+	// resumption_master_secret; the transcript must end with the client Finished
+	void tls13_resumption_secret()
+	{
+		if(cipher_index == -1)
+			return;
+		int hash_len = chiper_list()[cipher_index].hash_len;
+		u8	hash[MAX_HASH_LEN];
+		get_hash((char*)hash);
+		_private_tls_hkdf_expand_label(data13.res_secret, hash_len, data13.prk, hash_len, "res master", 10, hash, hash_len);
+	}
+	// PSK of a NewSessionTicket, returns its length
+	int tls13_ticket_psk(u8 *out, const u8 *nonce, int nonce_len)
+	{
+		if(cipher_index == -1)
+			return 0;
+		int hash_len = chiper_list()[cipher_index].hash_len;
+		_private_tls_hkdf_expand_label(out, hash_len, data13.res_secret, hash_len, "resumption", 10, nonce, nonce_len);
+		return hash_len;
+	}
+
 	void compute_verify(tlsbuf &out, bool client_or_server, int verify_size, bool tls_13, int local_or_remote)
 	{
 		if(cipher_index == -1)
@@ -782,39 +1347,51 @@ public:
 		return pub_key;
 	}
 
-	void encode(tlsbuf &sendbuf, const char *packet, int packet_size, bool keep_original, bool tls_13)
+	// Outgoing records are built in place: a 5-byte header, then
+	// record_body_size() bytes with the plaintext at plaintext_offset();
+	// encode() encrypts it where it is.
+	bool sealing()
+	{
+		return encoding && encoder != 0;
+	}
+	int record_body_size(int packet_size, bool tls_13)
+	{
+		return sealing() ? encoder->compute_size(packet_size, 0, tls_13) : packet_size;
+	}
+	int plaintext_offset(bool tls_13)
+	{
+		return sealing() ? encoder->explicit_iv_len(tls_13) : 0;
+	}
+	void encode(char *record, int packet_size, bool tls_13)
 	{
 	//	CLock lock(lockdata);
-		if(!encoding || encoder == 0 || keep_original)
-		{
-			sendbuf.append(packet, packet_size);
-			return ;
-		}
+		if(!sealing())
+			return;
 		
 		unsigned char aad[13];
 		if(tls_13 == false)
 		{
 			*((uint64_t *)aad) = htonll(client_sequence_number++);//htonll(packet->context->local_sequence_number);
-			aad[8]	= sendbuf.buf[0];
-			aad[9]	= sendbuf.buf[1];
-			aad[10] = sendbuf.buf[2];
+			aad[8]	= record[0];
+			aad[9]	= record[1];
+			aad[10] = record[2];
 			*((unsigned short *)(aad + 11)) = htons(packet_size);
 		}
 		else
 		{
 			aad[0] = CONTENT_APPLICATION_DATA;
-			aad[1] = sendbuf.buf[1];
-			aad[2] = sendbuf.buf[2];
+			aad[1] = record[1];
+			aad[2] = record[2];
 			*((unsigned short *)(aad + 3)) = htons(encoder->compute_size(packet_size, 0, tls_13));		//-header_size
 			*((uint64_t *)(aad+5)) = htonll(client_sequence_number++);
 		}
-		encoder->encode(sendbuf, packet, packet_size, aad, sizeof(aad), tls_13);
+		encoder->encode((unsigned char*)record + 5, packet_size, aad, sizeof(aad), tls_13);
 	}
 
 	char *decode(tlsbuf_reader &inout, int packet_type, int version, bool tls_13)
 	{
 	//	CLock lock(lockdata);
-		if(encoding == false || encoder == 0)
+		if(decoding == false || encoder == 0)
 			return 0;
 		unsigned char aad[13];
 		if(tls_13 == false)
@@ -833,13 +1410,7 @@ public:
 			*((unsigned short *)(aad + 3)) = htons(inout.buf_size);		//-header_size
 			*((uint64_t *)(aad+5)) = htonll(server_sequence_number++);
 		}
-		char *ret = encoder->decode(inout, decode_buf, aad, sizeof(aad), tls_13);
-		if(ret)
-			return ret;
-		inout.buf		= decode_buf.buf;
-		inout.buf_size	= decode_buf.size;
-		
-		return 0;
+		return encoder->decode(inout, aad, sizeof(aad), tls_13);
 	}
 
 	bool verify_serverkey_exchange(int hash_type, const char *sign, int sign_size, const char *message, int msg_size)
@@ -861,13 +1432,24 @@ public:
 		return chiper_list()[cipher_index].cipher;
 	}
 
+	// both directions at once, as TLS 1.3 switches keys; a full TLS 1.2
+	// handshake protects our records from our ChangeCipherSpec and the
+	// server's only from its own, which can come after a NewSessionTicket
 	void set_encoding(bool v)
+	{
+		encoding = decoding = v;
+	}
+	void set_write_encoding(bool v)
 	{
 		encoding = v;
 	}
-	bool get_encoding()
+	void set_read_encoding(bool v)
 	{
-		return encoding;
+		decoding = v;
+	}
+	bool get_read_encoding()
+	{
+		return decoding;
 	}
 
 	void reset_sequence_number()
@@ -875,10 +1457,233 @@ public:
 		client_sequence_number = 0;
 		server_sequence_number = 0;
 	}
+
+#ifdef TLS13_SELFTEST
+	// Known answers for the TLS 1.3 resumption, 0-RTT and HelloRetryRequest
+	// transcripts. Debug builds define TLS13_SELFTEST and run it through
+	// "mytls --selftest" after linking; it returns 0 or the name of the
+	// first check that failed.
+	static int selftest_hex(u8 *out, const char *hex)
+	{
+		int n = 0;
+		for(; hex[0] && hex[1]; hex += 2, n++)
+		{
+			int hi = hex[0] <= '9' ? hex[0] - '0' : hex[0] - 'a' + 10;
+			int lo = hex[1] <= '9' ? hex[1] - '0' : hex[1] - 'a' + 10;
+			out[n] = (u8)(hi << 4 | lo);
+		}
+		return n;
+	}
+	static bool selftest_equal(const u8 *value, const char *hex)
+	{
+		u8 expected[MAX_HASH_LEN];
+		return memcmp(value, expected, selftest_hex(expected, hex)) == 0;
+	}
+	// one protected TLS 1.3 record, built as tls_client::end_record() does
+	static int selftest_seal(tls_cipher &c, int type, const u8 *data, int size, u8 *record)
+	{
+		int body = c.record_body_size(size + 1, true);
+		record[0] = CONTENT_APPLICATION_DATA;
+		record[1] = 3;
+		record[2] = 3;
+		*(u_short*)(record + 3) = htons(body);
+		memcpy(record + 5, data, size);
+		record[5 + size] = (u8)type;
+		c.encode((char*)record, size + 1, true);
+		return 5 + body;
+	}
+	// keys a client and a server cipher for the same records, both ways
+	static void selftest_pair(tls_cipher &client, tls_cipher &server, int cipher, bool tls_13)
+	{
+		u8 rand[RAND_SIZE], key[2][MAX_KEY_SIZE], iv[2][MAX_IV_SIZE];
+		memset(rand, 0, sizeof(rand));
+		for(int i = 0; i < MAX_KEY_SIZE; i++)
+			key[0][i] = (u8)i, key[1][i] = (u8)(0x80 + i);
+		for(int i = 0; i < MAX_IV_SIZE; i++)
+			iv[0][i] = (u8)(0x40 + i), iv[1][i] = (u8)(0xc0 + i);
+		client.update_server_info(cipher, rand, tls_13);
+		server.update_server_info(cipher, rand, tls_13);
+		int key_len = client.chiper_list()[client.cipher_index].key_len;
+		client.encoder->init(key[0], key[1], iv[0], iv[1], key_len, tls_13);
+		server.encoder->init(key[1], key[0], iv[1], iv[0], key_len, tls_13);
+		client.set_encoding(true);
+		server.set_encoding(true);
+	}
+	static const char *tls13_selftest()
+	{
+		// RFC 8448 4: the resumed ClientHello, binders list last
+		static const char *client_hello =
+			"010001fc03031bc3ceb6bbe39cff938355b5a50adb6db21b7a6af649d7b4bc41"
+			"9d7876487d95000006130113031302010001cd0000000b000900000673657276"
+			"6572ff01000100000a00140012001d0017001800190100010101020103010400"
+			"3300260024001d0020e4ffb68ac05f8d96c99da26698346c6be16482badddafe"
+			"051a66b4f18d668f0b002a0000002b0003020304000d0020001e040305030603"
+			"020308040805080604010501060102010402050206020202002d00020101001c"
+			"0002400100150057000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"0000000000000000000000000000000000000000000000000000000000000000"
+			"2900dd00b800b22c035d829359ee5ff7af4ec900000000262a6494dc486d2c8a"
+			"34cb33fa90bf1b0070ad3c498883c9367c09a2be785abc55cd226097a3a98211"
+			"7283f82a03a143efd3ff5dd36d64e861be7fd61d2827db279cce145077d454a3"
+			"664d4e6da4d29ee03725a6a4dafcd0fc67d2aea70529513e3da2677fa5906c5b"
+			"3f7d8f92f228bda40dda721470f9fbf297b5aea617646fac5c03272e970727c6"
+			"21a79141ef5f7de6505e5bfbc388e93343694093934ae4d357fad6aacb002120"
+			"3add4fb2d8fdf822a0ca3cf7678ef5e88dae990141c5924d57bb6fa31b9e5f9d";
+		static const int binders_offset = 477;
+		// RFC 8448 3: secrets of the first handshake
+		static const char *handshake_secret	= "1dc826e93606aa6fdc0aadc12f741b01046aa6b99f691ed221a9f0ca043fbeac";
+		static const char *master_secret	= "18df06843d13a08bf2a449844c5f8a478001bc4d4c627984d5a41da8d0402919";
+		static const char *res_master		= "7df235f2031d2a051287d02b0241b0bfdaf86cc856231f2d5aba46c434ec196c";
+		// RFC 8448 3/4: ticket PSK for nonce 00 00, binder of the ClientHello
+		static const char *ticket_psk		= "4ecd0eb6ec3b4d87f5d6028f922ca4c5851a277fd41311c9e62d2c9492e1c4f3";
+		static const char *binder			= "3add4fb2d8fdf822a0ca3cf7678ef5e88dae990141c5924d57bb6fa31b9e5f9d";
+		// The transcript behind the RFC 8448 3 res master is not embedded here,
+		// so this one takes the ClientHello above as the transcript:
+		// HKDF-Expand-Label(master_secret, "res master", SHA-256(client_hello)).
+		// Not an RFC vector: computed with OpenSSL (dgst, kdf HKDF), not this code
+		static const char *res_master_hello	= "32777f10f387c746279c117c7a3311df7a037dee592063d76edebdb6062aa706";
+		// RFC 8448 4: client_early_traffic_secret keys, the early data
+		// "ABCDEF" and EndOfEarlyData, the second record under those keys
+		static const char *early_key		= "920205a5b7bf2115e6fc5c2942834f54";
+		static const char *early_iv			= "6d475f0993c8e564610db2b9";
+		static const char *early_record		= "1703030017ab1df420e75c457a7cc5d2844f76d5aee4b4edbf049be0";
+		static const char *end_of_early		= "1703030015aca6fc944841298df99593725f9bf9754429b12f09";
+		// HelloRetryRequest for secp256r1, suite at offset 40, answered by
+		// the same ClientHello: Hash(message_hash || HRR || ClientHello2)
+		// for SHA-256 and SHA-384, and the binder over the truncated
+		// ClientHello2 (RFC 8446 4.4.1, 4.2.11.2). RFC 8448 5 is not embedded,
+		// so the HRR is made up; the expected values come from OpenSSL
+		// (dgst, kdf HKDF, mac HMAC), which also reproduces the 4 binder
+		static const char *hello_retry =
+			"020000340303cf21ad74e59a6111be1d8c021e65b891c2a211167abb8c5e079e"
+			"09e2c8a8339c00130100000c003300020017002b00020304";
+		static const char *retry_sha256		= "0e97f977c726535c25b63d34f2fce74b842a22cc11db3cfa462d33c3617f98a5";
+		static const char *retry_sha384		= "45b8401ccbafc23719b0ec95367c11133a71cc4a56359b5e1fca8ab7f840f844"
+											  "7315e994f61310a24d95d82a89231aba";
+		static const char *retry_binder		= "8643b5d2090a001959764acbc64dba2de3d51b913899989dacbb6fce97a49757";
+
+		u8	hello[512], psk[MAX_HASH_LEN], out[MAX_HASH_LEN], finished[MAX_HASH_LEN], rand[RAND_SIZE];
+		int	hello_len = selftest_hex(hello, client_hello);
+		selftest_hex(psk, ticket_psk);
+		memset(finished, 0, sizeof(finished));
+		memset(rand, 0, sizeof(rand));
+		aes_init_keygen_tables();
+
+		// the application stage turns the handshake secret into the master secret
+		tls_cipher resumption;
+		resumption.update_server_info(TLS_AES_128_GCM_SHA256, rand, true);
+		selftest_hex(resumption.data13.prk, handshake_secret);
+		if(resumption.tls13_compute_key(ECC_NONE, 0, 0, (char*)finished) || !selftest_equal(resumption.data13.prk, master_secret))
+			return "master secret";
+		resumption.update_hash((char*)hello, hello_len);
+		resumption.tls13_resumption_secret();
+		if(!selftest_equal(resumption.data13.res_secret, res_master_hello))
+			return "res master";
+		selftest_hex(resumption.data13.res_secret, res_master);
+		u8 nonce[2] = {0, 0};
+		if(resumption.tls13_ticket_psk(out, nonce, sizeof(nonce)) != 32 || !selftest_equal(out, ticket_psk))
+			return "ticket psk";
+
+		// the binder covers the ClientHello up to its binders list
+		tls_cipher early;
+		early.compute_binder(out, psk, 32, (char*)hello, binders_offset);
+		if(!selftest_equal(out, binder))
+			return "res binder";
+
+		// 0-RTT right after the ClientHello
+		u8	record[64];
+		early.update_hash((char*)hello, hello_len);
+		if(early.tls13_early_key(TLS_AES_128_GCM_SHA256, psk, 32) || !selftest_equal(early.early_key, early_key) || !selftest_equal(early.early_iv, early_iv))
+			return "c e traffic";
+		early.set_encoding(true);
+		if(selftest_seal(early, CONTENT_APPLICATION_DATA, (const u8*)"ABCDEF", 6, record) != 28 || !selftest_equal(record, early_record))
+			return "early data";
+		// the ServerHello takes the PSK; EndOfEarlyData still goes out under
+		// the early keys, numbered after the early data
+		early.set_encoding(false);
+		early.update_server_info(TLS_AES_128_GCM_SHA256, rand, true);
+		early.set_psk(psk, 32);
+		if(early.tls13_compute_key(ECC_NONE, 0, 0, 0) || early.tls13_early_sending(true))
+			return "handshake keys";
+		early.set_encoding(true);
+		u8 end_of_early_data[4] = {MSG_END_OF_EARLY_DATA, 0, 0, 0};
+		if(selftest_seal(early, CONTENT_HANDSHAKE, end_of_early_data, 4, record) != 26 || !selftest_equal(record, end_of_early))
+			return "EndOfEarlyData";
+		if(early.tls13_early_sending(false) || early.client_sequence_number != 0)
+			return "client handshake keys";
+
+		// HelloRetryRequest, in on_hello_retry() order, for both hashes
+		u8	retry[64];
+		int	retry_len = selftest_hex(retry, hello_retry);
+		for(int i = 0; i < 2; i++)
+		{
+			int suite = i ? TLS_AES_256_GCM_SHA384 : TLS_AES_128_GCM_SHA256;
+			retry[40] = (u8)suite;
+			tls_cipher second;
+			second.update_hash((char*)hello, hello_len);
+			second.save_hello_hash();
+			second.update_hash((char*)retry, retry_len);
+			second.update_server_info(suite, rand, true);
+			second.retry_hash((char*)retry, retry_len);
+			if(i == 0)
+			{
+				second.compute_binder(out, psk, 32, (char*)hello, binders_offset);
+				if(!selftest_equal(out, retry_binder))
+					return "binder after HelloRetryRequest";
+			}
+			second.update_hash((char*)hello, hello_len);
+			second.get_hash((char*)out);
+			if(!selftest_equal(out, i ? retry_sha384 : retry_sha256))
+				return "message_hash";
+		}
+		return 0;
+	}
+#endif
 };
 
 
 
+struct tls_send_stats
+{
+	unsigned	writes;			// records the writes would have taken one by one
+	unsigned	records;		// records actually sent
+	unsigned	syscalls;		// ::send() calls
+	unsigned	records_saved;	// writes - records
+	unsigned	bytes_saved;	// record header and AEAD overhead not sent
+};
+
+// one caller buffer of tls_client::sendv()
+struct tls_iovec
+{
+	const char	*buf;
+	int			size;
+};
+
+// A TLS 1.3 ticket from NewSessionTicket and the PSK derived for it
+struct tls_session_ticket
+{
+	TLS_CIPHER	cipher;
+	std::string	ticket;
+	u8			psk[MAX_HASH_LEN];
+	int			psk_len;
+	unsigned	age_add;
+	unsigned	lifetime;	// seconds
+	DWORD		received;	// GetTickCount()
+	unsigned	max_early_data;	// 0: no 0-RTT with this ticket
+};
+
+// A TLS 1.2 session: the master secret with the session ID and/or the
+// RFC 5077 ticket that lets the server find it again
+struct tls12_session
+{
+	TLS_CIPHER	cipher;
+	u8			master_key[48];
+	std::string	session_id;
+	std::string	ticket;
+	bool		extended_master;	// RFC 7627, must match on resumption
+	unsigned	lifetime;	// seconds
+	DWORD		received;	// GetTickCount()
+};
 
 class tls_client
 {
@@ -896,17 +1701,32 @@ class tls_client
 								{CONTENT_CHANGECIPHERSPEC, MSG_CHANGE_CIPHER_SPEC}, 
 								{CONTENT_HANDSHAKE, MSG_FINISHED}}; 
 
+		// abbreviated TLS 1.2 handshake, the server finishes first
+		static tlsstate s12_resume[] = {{CONTENT_HANDSHAKE, MSG_SERVER_HELLO}, 
+								{CONTENT_CHANGECIPHERSPEC, MSG_CHANGE_CIPHER_SPEC}, 
+								{CONTENT_HANDSHAKE, MSG_FINISHED}}; 
+
 		static tlsstate s13[] = {{CONTENT_HANDSHAKE, MSG_SERVER_HELLO}, 
 								{CONTENT_CHANGECIPHERSPEC, MSG_CHANGE_CIPHER_SPEC}, 
 								{CONTENT_HANDSHAKE, MSG_ENCRYPTED_EXTENSIONS}, 
 								{CONTENT_HANDSHAKE, MSG_CERTIFICATE}, 
 								{CONTENT_HANDSHAKE, MSG_CERTIFICATE_VERIFY}, 
 								{CONTENT_HANDSHAKE, MSG_FINISHED}};
-		return tls_13 ? s13 : s12;
+
+		// resumed with a PSK: no Certificate / CertificateVerify
+		static tlsstate s13_psk[] = {{CONTENT_HANDSHAKE, MSG_SERVER_HELLO}, 
+								{CONTENT_CHANGECIPHERSPEC, MSG_CHANGE_CIPHER_SPEC}, 
+								{CONTENT_HANDSHAKE, MSG_ENCRYPTED_EXTENSIONS}, 
+								{CONTENT_HANDSHAKE, MSG_FINISHED}};
+		if(tls_13)
+			return psk_accepted ? s13_psk : s13;
+		return session_resumed ? s12_resume : s12;
 	}
 	int get_states_count(bool tls_13)
 	{
-		return tls_13 ? 6 : 4;	//tls12ÔÚhello doneÖ±½ÓÔÊÐí·¢ËÍÏûÏ¢
+		if(tls_13)
+			return psk_accepted ? 4 : 6;
+		return session_resumed ? 3 : 4;	//tls12ÔÚhello doneÖ±½ÓÔÊÐí·¢ËÍÏûÏ¢
 	}
 	int get_states_count()
 	{
@@ -917,59 +1737,230 @@ class tls_client
 	int					state_index	= 0;
 
 	tlsbuf				send_buf;
+	tlsbuf				send_out;			// records waiting for ::send, reused
+	static const int	send_out_flush		= 256*1024;
+	int					open_record			= -1;	// application record still being filled
+	int					open_used			= 0;
+	int					open_capacity		= 0;
+	bool				corked				= false;
+	int					nagle_us			= 0;	// 0: every write goes out at once
+	int64_t				nagle_deadline		= 0;
+	// The Nagle timer fires on a pool thread, so everything that builds or
+	// sends records holds send_lock
+	CLockData			send_lock;
+	HANDLE				nagle_queue			= 0;	// per client, so the destructor can wait for it
+	HANDLE				nagle_timer			= 0;
+	tls_send_stats		send_stats;
+	int					record_overhead		= 0;	// of the last record, for bytes_saved
+	// Dynamic record sizing: while TCP is in slow start a 16 KB record spans
+	// several round trips before it can be decrypted, so the first records
+	// fit one segment each; after record_warm_count of them, or again after
+	// record_idle_us without writes, the size switches.
+	static const int	record_max_size		= 16384;	// RFC 8446 5.1, RFC 5246 6.2.1
+	static const int	record_small_size	= 1369;		// 1500 MTU - IP/TCP headers and options - record overhead
+	static const int	record_warm_count	= 40;
+	static const int	record_idle_us		= 1000000;
+	tls_record_sizing	record_sizing		= record_dynamic;
+	int					record_size			= record_max_size;	// set_record_sizing()
+	int					records_sent		= 0;	// application records since the last idle period
+	int64_t				last_send_us		= 0;
+	tls_trace_fn		trace_fn			= 0;	// set_trace(), off by default
+	void				*trace_ctx			= 0;
+	// Records are decrypted in place in recv_buf; the application data is
+	// not copied out but listed in recv_spans until the caller reads it.
+	struct recv_span
+	{
+		int offset, size;
+	};
 	tlsbuf				recv_buf;
-	tlsbuf				recv_channel;
+	int					recv_parsed			= 0;	// recv_buf up to here is processed records
+	std::vector<recv_span>	recv_spans;
+	int					recv_span_index		= 0;	// first unread span
+	int					recv_pending		= 0;	// unread application bytes
 	tlsbuf				err_msg;
-	int					recv_channel_readed	= 0;
 	int					time_out			= 0x7fffffff;
 	bool				received_close_notify = false;
 
+	std::string			host;
+	tls_version			version				= tls12;
+	ECC_GROUP			share_group			= ECC_NONE;	// the one key share offered
+	bool				hello_retry			= false;
+	tlsbuf				hello_retry_cookie;
+
+	std::string			session_key;		// host:port in the session cache
+	tls_resumption		resumption			= resume_psk_dhe;
+	tls_session_ticket	offered_ticket;
+	bool				psk_offered			= false;
+	bool				psk_accepted		= false;
+
+	tls12_session		offered_session;	// TLS 1.2 session offered in the ClientHello
+	tls12_session		new_session;		// the one this handshake establishes
+	bool				session_offered		= false;
+	bool				session_resumed		= false;
+	bool				extended_master		= false;	// TLS 1.2 server agreed to RFC 7627
+
+	int					recv_record_limit	= 0;	// record_size_limit we send, 0: none
+	int					recv_record_max		= 0;	// ours once the server agreed, for this version
+	int					send_record_limit	= 0;	// the server's, as plaintext bytes per record
+
+	tlsbuf				early_data;			// for the first flight of the next open()
+	bool				early_offered		= false;
+	tls_early_data		early_status		= early_none;
+
 	bool is_tls13(TLS_CIPHER cipher)
 	{
 		return cipher >= TLS_AES_128_GCM_SHA256 && cipher <= TLS_AES_128_CCM_8_SHA256;
 	}
 
-	const char *send_packet(int packet_type, int ver, tlsbuf &buf)
+	// Reserves a record for up to `capacity` plaintext bytes at the end of
+	// send_out and returns where the plaintext goes. end_record() closes it
+	// with the size actually used and encrypts it in place.
+	bool record_sealed(int packet_type)
 	{
-		if(packet_type == CONTENT_HANDSHAKE && buf.size > 0)
-			crypto.update_hash(buf.buf, buf.size);
-		tlsbuf tmp_buf;
-		tmp_buf.append((char)packet_type);
-		tmp_buf.append((short)ver);
-		int		body_size_index = tmp_buf.append_size(2);	//tls body size
+		bool keep_original = packet_type == CONTENT_CHANGECIPHERSPEC || packet_type == CONTENT_ALERT;
+		return keep_original == false && crypto.sealing();
+	}
+	char *record_plaintext(int packet_type, int record)
+	{
+		return send_out.buf + record + 5 + (record_sealed(packet_type) ? crypto.plaintext_offset(is_tls13(crypto.get_chiper_type())) : 0);
+	}
+	char *begin_record(int packet_type, int capacity, int &record)
+	{
+		bool	tls_13	= is_tls13(crypto.get_chiper_type());
+		send_out.check_size(5 + (record_sealed(packet_type) ? crypto.record_body_size(capacity + 1, tls_13) : capacity));
+		record = send_out.size;
+		return record_plaintext(packet_type, record);
+	}
+	void end_record(int packet_type, int ver, int record, int size)
+	{
+		bool	sealed	= record_sealed(packet_type);
+		bool	tls_13	= is_tls13(crypto.get_chiper_type());
+		int		inner	= sealed && tls_13 ? size + 1 : size;	// TLS 1.3 content type byte
+		int		body	= sealed ? crypto.record_body_size(inner, tls_13) : inner;
 
-		bool	keep_original	= packet_type == CONTENT_CHANGECIPHERSPEC || packet_type == CONTENT_ALERT;
-		if(keep_original == false && crypto.get_encoding() && is_tls13(crypto.get_chiper_type()))
+		if(sealed && tls_13)
+			record_plaintext(packet_type, record)[size] = (char)packet_type;
+		send_out.buf[record] = sealed && tls_13 ? CONTENT_APPLICATION_DATA : packet_type;
+		*(short*)(send_out.buf + record + 1) = (short)ver;
+		*(u_short*)(send_out.buf + record + 3) = htons(body);	//tls body size
+		send_out.size = record + 5 + body;
+		if(sealed)
+			crypto.encode(send_out.buf + record, inner, tls_13);		//-----------¼ÓÃÜ´úÂë
+		send_stats.records++;
+		record_overhead = 5 + body - size;
+	}
+	void close_open_record()
+	{
+		if(open_record < 0)
+			return;
+		trace(trace_plaintext_out, record_plaintext(CONTENT_APPLICATION_DATA, open_record), open_used);
+		end_record(CONTENT_APPLICATION_DATA, 0x303, open_record, open_used);
+		open_record	= -1;
+		open_used	= 0;
+		records_sent++;
+	}
+	static int64_t now_us()
+	{
+		LARGE_INTEGER counter, frequency;
+		QueryPerformanceCounter(&counter);
+		QueryPerformanceFrequency(&frequency);
+		return counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+	}
+	void trace(tls_trace_event event, const char *data, int size)
+	{
+		if(trace_fn)
+			trace_fn(trace_ctx, event, data, size);
+	}
+	static VOID CALLBACK nagle_proc(PVOID param, BOOLEAN)
+	{
+		tls_client *client = (tls_client*)param;
+		CLock lock(client->send_lock);
+		// a write, recv() or flush() may have sent the record already
+		if(client->nagle_deadline != 0 && client->open_record >= 0 && !client->corked && client->s != INVALID_SOCKET)
+			client->flush_pending();	// a failed send shows up on the next call
+	}
+	// one-shot timer for the record just held back; the timer queue counts
+	// whole milliseconds, so the delay is rounded up
+	void arm_nagle_timer()
+	{
+		if(nagle_queue == 0 && (nagle_queue = CreateTimerQueue()) == 0)
+			return;		// then only the next sendv(), recv() or flush() sends it
+		if(nagle_timer)
+			DeleteTimerQueueTimer(nagle_queue, nagle_timer, 0);	// already fired, does not wait
+		nagle_timer = 0;
+		if(!CreateTimerQueueTimer(&nagle_timer, nagle_queue, nagle_proc, this, (nagle_us + 999) / 1000, 0, WT_EXECUTEDEFAULT | WT_EXECUTEONLYONCE))
+			nagle_timer = 0;
+	}
+	// sends everything written so far, the half-filled record included
+	const char *flush_pending()
+	{
+		close_open_record();
+		nagle_deadline = 0;
+		return flush_send_out();
+	}
+	const char *flush_send_out()
+	{
+		if(send_out.size == 0)
+			return 0;
+		trace(trace_record_out, send_out.buf, send_out.size);
+		for(int sent = 0; sent < send_out.size;)
 		{
-			buf.append((char)packet_type);
-			tmp_buf.buf[0] = CONTENT_APPLICATION_DATA;
+			int len = ::send(s, send_out.buf + sent, send_out.size - sent, 0);
+			send_stats.syscalls++;
+			if(len <= 0)
+			{
+				send_out.clear();
+				return "·¢ËÍÊý¾ÝÊ§°Ü";
+			}
+			sent += len;
 		}
 
-		crypto.encode(tmp_buf, buf.buf, buf.size, keep_original, is_tls13(crypto.get_chiper_type()));		//-----------¼ÓÃÜ´úÂë
-
-		*(u_short*)(tmp_buf.buf+body_size_index) = htons(tmp_buf.size - body_size_index - 2);
-		std::ofstream tls_record_log("tls_record.log", std::ios::app | std::ios::binary);
-		tls_record_log.write(tmp_buf.buf, tmp_buf.size);
-		tls_record_log.close();
-		if( ::send(s, tmp_buf.buf, tmp_buf.size, 0) != tmp_buf.size)
-			return "·¢ËÍÊý¾ÝÊ§°Ü";
-
-		DumpData("·¢ËÍÊý¾Ý:", tmp_buf.buf, tmp_buf.size);
+		DumpData("·¢ËÍÊý¾Ý:", send_out.buf, send_out.size);
+		send_out.clear();
 		return 0;
 	}
+
+	const char *send_packet(int packet_type, int ver, tlsbuf &buf)
+	{
+		CLock lock(send_lock);
+		if(packet_type == CONTENT_HANDSHAKE && buf.size > 0)
+			crypto.update_hash(buf.buf, buf.size);
+		close_open_record();	// keeps corked application data in order
+		int record;
+		memcpy(begin_record(packet_type, buf.size, record), buf.buf, buf.size);
+		end_record(packet_type, ver, record, buf.size);
+		return flush_send_out();
+	}
 	
 	const char* send_client_hello(SOCKET s, const char* host, tls_version version)
 	{
 		send_buf.clear();
 
 		bool hastls13 = false;
+		int  binders_index = 0;
 
 		send_buf.append((char)MSG_CLIENT_HELLO);
 		int handshake_size_index = send_buf.append_size(3); // tls handshake body size
 
 		send_buf.append((short)0x303);
-		send_buf.append(crypto.create_client_rand(), RAND_SIZE);
-		send_buf.append((char)0); // session id, usually 0
+		send_buf.append(hello_retry ? crypto.get_client_rand() : crypto.create_client_rand(), RAND_SIZE);
+
+		// TLS 1.2 resumption: the cached session ID, or for a ticket alone a
+		// random one the server echoes when it accepts the ticket (RFC 5077 3.4)
+		if (!hello_retry)
+		{
+			session_offered = resumption != resume_none && get_session12(session_key, offered_session);
+			if (session_offered && offered_session.session_id.empty())
+			{
+				char id[32];
+				if (!getRandomBytes(id, sizeof(id)))
+					return "Éú³ÉËæ»úsession idÊ§°Ü";
+				offered_session.session_id.assign(id, sizeof(id));
+			}
+		}
+		send_buf.append((char)(session_offered ? offered_session.session_id.size() : 0)); // session id
+		if (session_offered)
+			send_buf.append(offered_session.session_id.data(), (int)offered_session.session_id.size());
 
 		int ciper_count_index = send_buf.append_size(2);
 		for (int i = 0; i < crypto.chiper_count; i++)
@@ -1017,6 +2008,28 @@ class tls_client
 		for (int i = 0; i < crypto.ecc_count; i++)
 			send_buf.append(htons(crypto.ecc_list()[i].iana));
 
+		// --- Extended Master Secret Extension (RFC 7627) ---
+		send_buf.append(htons(EXT_EXTENDED_MASTER_SECRET));
+		send_buf.append(htons(0));
+
+		// --- Record Size Limit Extension (RFC 8449) ---
+		if (recv_record_limit > 0)
+		{
+			send_buf.append(htons(EXT_RECORD_SIZE_LIMIT));
+			send_buf.append(htons(2));
+			send_buf.append(htons(record_limit_for(hastls13)));
+		}
+
+		// --- SessionTicket Extension (RFC 5077), empty asks for a new one ---
+		if (resumption != resume_none)
+		{
+			int ticket_len = session_offered ? (int)offered_session.ticket.size() : 0;
+			send_buf.append(htons(EXT_SESSIONTICKET_TLS));
+			send_buf.append(htons(ticket_len));
+			if (ticket_len > 0)
+				send_buf.append(offered_session.ticket.data(), ticket_len);
+		}
+
 		// --- TLS 1.3 Extensions ---
 		if (hastls13)
 		{
@@ -1040,28 +2053,138 @@ class tls_client
 			send_buf.append(htons(0x0203)); //
 			send_buf.append(htons(0x0201)); //
 
+			// one ticket per connection; after a HelloRetryRequest it can
+			// only be offered again if its hash matches the chosen suite
+			if (!hello_retry)
+				psk_offered = resumption != resume_none && take_session(session_key, offered_ticket);
+			else if (psk_offered && offered_ticket.psk_len != crypto.get_hash_size())
+				psk_offered = false;
+
+			if (resumption != resume_none)
+			{
+				send_buf.append(htons(EXT_PSK_KEY_EXCHANGE_MODES));
+				if (resumption == resume_psk)
+				{
+					send_buf.append(htons(3));
+					send_buf.append((char)2);
+					send_buf.append((char)0); // psk_ke
+				}
+				else
+				{
+					send_buf.append(htons(2));
+					send_buf.append((char)1);
+				}
+				send_buf.append((char)1); // psk_dhe_ke
+			}
+
+			// only one key share: the group this host picked last time, or
+			// our first choice; a HelloRetryRequest asks for another one.
+			// For psk_ke none at all, so a resumption costs no ECDH
+			if (!hello_retry)
+			{
+				share_group = get_cached_group(host);
+				if (crypto.get_ecc_index(share_group) < 0)
+					share_group = crypto.ecc_list()[0].iana;
+				if (psk_offered && resumption == resume_psk)
+					share_group = ECC_NONE;
+			}
 			send_buf.append(htons(EXT_KEY_SHARE)); // extension type
 			int share_size = send_buf.append_size(2);
 			send_buf.append_size(2);
-			for (int i = 0; i < crypto.ecc_count; i++)
+			if (share_group != ECC_NONE)
 			{
-				auto& ecc = crypto.ecc_list()[i];
-				send_buf.append(htons(ecc.iana));
+				send_buf.append(htons(share_group));
 				int share_size_sub = send_buf.append_size(2);
-				const char* ret = crypto.compute_pubkey(i, send_buf);
+				const char* ret = crypto.compute_pubkey(crypto.get_ecc_index(share_group), send_buf);
 				if (ret)
 					return ret;
 				*(u_short*)(send_buf.buf + share_size_sub) = htons(send_buf.size - share_size_sub - 2);
 			}
 			*(u_short*)(send_buf.buf + share_size) = htons(send_buf.size - share_size - 2);
 			*(u_short*)(send_buf.buf + share_size + 2) = htons(send_buf.size - share_size - 4);
+
+			if (hello_retry_cookie.size > 0)
+			{
+				send_buf.append(htons(EXT_COOKIE));
+				send_buf.append(htons(hello_retry_cookie.size + 2));
+				send_buf.append(htons(hello_retry_cookie.size));
+				send_buf.append(hello_retry_cookie.buf, hello_retry_cookie.size);
+			}
+
+			// 0-RTT only in the first ClientHello and within the ticket's limit
+			early_offered = psk_offered && !hello_retry && early_data.size > 0 && (unsigned)early_data.size <= offered_ticket.max_early_data;
+			if (early_offered)
+			{
+				send_buf.append(htons(EXT_EARLY_DATA));
+				send_buf.append(htons(0));
+			}
+
+			// pre_shared_key must be the last extension (RFC 8446 4.2.11)
+			if (psk_offered)
+			{
+				int ticket_len = (int)offered_ticket.ticket.size();
+				int binder_len = offered_ticket.psk_len;
+				unsigned age = GetTickCount() - offered_ticket.received + offered_ticket.age_add;
+				send_buf.append(htons(EXT_PRESHARED_KEY));
+				send_buf.append(htons(2 + 2 + ticket_len + 4 + 2 + 1 + binder_len)); // ext size
+				send_buf.append(htons(2 + ticket_len + 4));		// identities
+				send_buf.append(htons(ticket_len));
+				send_buf.append(offered_ticket.ticket.data(), ticket_len);
+				send_buf.append((unsigned int)htonl(age));		// obfuscated_ticket_age
+				binders_index = send_buf.append_size(2);		// binders, filled in below
+				*(u_short*)(send_buf.buf + binders_index) = htons(1 + binder_len);
+				send_buf.append((char)binder_len);
+				send_buf.append_size(binder_len);
+			}
 		}
 
 		*(u_short*)(send_buf.buf + ext_size_index) = htons(send_buf.size - ext_size_index - 2);
 		send_buf.buf[handshake_size_index] = 0;
 		*(u_short*)(send_buf.buf + handshake_size_index + 1) = htons(send_buf.size - handshake_size_index - 3);
+		// the binder covers the finished ClientHello up to the binders list
+		if (psk_offered)
+			crypto.compute_binder((u8*)send_buf.buf + send_buf.size - offered_ticket.psk_len, offered_ticket.psk, offered_ticket.psk_len, send_buf.buf, binders_index);
+
+		const char *ret = send_packet(CONTENT_HANDSHAKE, 0x303, send_buf);
+		if (ret == 0 && !hello_retry)
+			crypto.save_hello_hash();
+		if (ret == 0 && early_offered)
+			ret = send_early_data();
+		return ret;
+	}
 
-		return send_packet(CONTENT_HANDSHAKE, 0x303, send_buf);
+	// the early data records follow the ClientHello without waiting
+	const char *send_early_data()
+	{
+		const char *ret = crypto.tls13_early_key(offered_ticket.cipher, offered_ticket.psk, offered_ticket.psk_len);
+		if (ret)
+			return ret;
+		crypto.set_encoding(true);
+		for (int i = 0; i < early_data.size && ret == 0;)
+		{
+			int send_size = min(early_data.size - i, 16384);
+			send_buf.set_size(send_size);
+			memcpy(send_buf.buf, early_data.buf + i, send_size);
+			ret = send_packet(CONTENT_APPLICATION_DATA, 0x303, send_buf);
+			i += send_size;
+		}
+		// the ServerHello is still plaintext
+		crypto.set_encoding(false);
+		return ret;
+	}
+
+	const char *send_end_of_early_data()
+	{
+		const char *ret = crypto.tls13_early_sending(true);
+		if (ret)
+			return ret;
+		send_buf.clear();
+		send_buf.append((char)MSG_END_OF_EARLY_DATA);
+		send_buf.append((char)0);
+		send_buf.append((short)0);
+		if (ret = send_packet(CONTENT_HANDSHAKE, 0x303, send_buf))
+			return ret;
+		return crypto.tls13_early_sending(false);
 	}
 
 
@@ -1108,34 +2231,49 @@ class tls_client
 		int server_hello_size = ntohl(reader.read<char>()<<8 | reader.read<short>()<<16);
 		int ver = ntohs(reader.read<short>());
 		reader.read(server_rand, sizeof(server_rand));
-		int session_len = reader.read<char>();
+		int session_len = reader.read<unsigned char>();
+		new_session.session_id.assign(reader.buf + reader.readed, session_len);
 		reader.readed += session_len;
 		TLS_CIPHER	cur_cipher	= (TLS_CIPHER)ntohs(reader.read<short>());	//Ñ¡ÔñµÄÃÜÂëÌ×¼þ
 		int			compress	= reader.read<char>();		//Ñ¹Ëõ·½Ê½
 
+		if(hello_retry && cur_cipher != crypto.get_chiper_type())
+			return "ServerHelloµÄ¼ÓÃÜÌ×¼þÓëHelloRetryRequest²»Ò»ÖÂ";
 		const char *ret = crypto.update_server_info(cur_cipher, server_rand, is_tls13(cur_cipher));
 		if(ret)
 			return ret;
 
+		// TLS 1.2: echoing the offered session ID accepts the session or ticket
+		if(!is_tls13(cur_cipher) && session_offered && session_len > 0 && new_session.session_id == offered_session.session_id)
+		{
+			if(cur_cipher != offered_session.cipher)
+				return "»Ö¸´µÄ»á»°¸Ä±äÁË¼ÓÃÜÌ×¼þ";
+			session_resumed = true;
+			new_session = offered_session;
+			if(ret = crypto.tls12_resume_key(offered_session.master_key))
+				return ret;
+		}
+
 		if(reader.readed >= reader.buf_size)
-			return 0;
+			return session_resumed && offered_session.extended_master ? "»Ö¸´µÄ»á»°¸Ä±äÁËextended_master_secret" : 0;
 
 		int ext_size	= ntohs(reader.read<short>());
 		int ext_start	= reader.readed;
 		int tls_ver		= 0;
-		tlsbuf		pubkey;
+		int			psk_identity = -1;
+		tlsbuf		pubkey, cookie;
 		ECC_GROUP	eccgroup = ECC_NONE;
 		while(reader.readed < ext_start + ext_size)
 		{
 			SSL_EXTENTION type = (SSL_EXTENTION)ntohs(reader.read<short>());
+			int size = ntohs(reader.read<short>());
+			int next = reader.readed + size;
 			if(type == EXT_SUPPORTED_VERSION)
 			{
-				reader.read<short>();
 				tls_ver= ntohs(reader.read<short>());
 			}
 			else if(type == EXT_KEY_SHARE)
 			{
-				int size = ntohs(reader.read<short>());
 				eccgroup = (ECC_GROUP)ntohs(reader.read<short>());
 				if(size > 4)
 				{
@@ -1143,16 +2281,146 @@ class tls_client
 					reader.read(pubkey.buf, pubkey.size);
 				}
 			}
+			else if(type == EXT_COOKIE)
+			{
+				cookie.set_size(ntohs(reader.read<short>()));
+				reader.read(cookie.buf, cookie.size);
+			}
+			else if(type == EXT_PRESHARED_KEY)
+			{
+				psk_identity = ntohs(reader.read<short>());
+			}
+			else if(type == EXT_EXTENDED_MASTER_SECRET)
+			{
+				extended_master = true;
+			}
+			else if(type == EXT_RECORD_SIZE_LIMIT && !is_tls13(cur_cipher))
+			{
+				if(ret = set_record_limits(ntohs(reader.read<unsigned short>()), false))
+					return ret;
+			}
+			reader.readed = next;
 		}
+		if(memcmp(server_rand, hello_retry_random(), RAND_SIZE) == 0)
+			return on_hello_retry(reader, tls_ver, eccgroup, cookie);
+		if(session_resumed && extended_master != offered_session.extended_master)
+			return "»Ö¸´µÄ»á»°¸Ä±äÁËextended_master_secret";
 		if(tls_ver != 0)
 		{
-			if(tls_ver != 0x0304 || pubkey.size <= 0 || eccgroup == ECC_NONE)
+			if(psk_identity >= 0)
+			{
+				if(!psk_offered || psk_identity != 0 || offered_ticket.psk_len != crypto.get_hash_size())
+					return "ServerHelloÑ¡ÔñÁËÃ»ÓÐÌá¹©µÄPSK";
+				psk_accepted = true;
+				crypto.set_psk(offered_ticket.psk, offered_ticket.psk_len);
+			}
+			// without a key share the server must have chosen psk_ke
+			bool psk_ke = psk_accepted && resumption == resume_psk && pubkey.size <= 0 && eccgroup == ECC_NONE;
+			if(tls_ver != 0x0304 || (!psk_ke && (pubkey.size <= 0 || eccgroup != share_group)))
 				return "·µ»ØµÄÍÖÔ²²ÎÊý²»ÕýÈ·";
 			const char *ret;
 			if(ret = crypto.tls13_compute_key(eccgroup, pubkey.buf, pubkey.size, 0))
 				return ret;
 			crypto.set_encoding(true);
+			if(eccgroup != ECC_NONE)
+				set_cached_group(host, eccgroup);
+		}
+		return 0;
+	}
+
+	// plaintext bytes for the next application record
+	int record_fragment_size()
+	{
+		int size = send_record_limit > 0 ? min(send_record_limit, record_size) : record_size;
+		if(record_sizing == record_dynamic && records_sent < record_warm_count)
+			size = min(size, record_small_size);
+		return size;
+	}
+
+	// RFC 8449 4: the protocol maximum is 2^14 for TLS 1.2 and 2^14 + 1 for
+	// TLS 1.3, where the limit also counts the inner content type byte
+	int record_limit_for(bool tls_13)
+	{
+		return min(recv_record_limit, tls_13 ? record_max_size + 1 : record_max_size);
+	}
+	// Both sides sent record_size_limit: the server's caps the plaintext of
+	// what we send, ours that of what it sends, each at the maximum of the
+	// negotiated version
+	const char *set_record_limits(int limit, bool tls_13)
+	{
+		if(limit < 64)
+			return "´íÎóµÄrecord_size_limit";
+		limit = min(limit, tls_13 ? record_max_size + 1 : record_max_size);
+		send_record_limit = tls_13 ? limit - 1 : limit;
+		recv_record_max = record_limit_for(tls_13);
+		return 0;
+	}
+
+	// ServerHello.random of a HelloRetryRequest, SHA-256("HelloRetryRequest")
+	static const char *hello_retry_random()
+	{
+		static const unsigned char r[RAND_SIZE] = {
+			0xCF, 0x21, 0xAD, 0x74, 0xE5, 0x9A, 0x61, 0x11, 0xBE, 0x1D, 0x8C, 0x02, 0x1E, 0x65, 0xB8, 0x91,
+			0xC2, 0xA2, 0x11, 0x16, 0x7A, 0xBB, 0x8C, 0x5E, 0x07, 0x9E, 0x09, 0xE2, 0xC8, 0xA8, 0x33, 0x9C};
+		return (const char *)r;
+	}
+
+	const char *on_hello_retry(tlsbuf_reader &reader, int tls_ver, ECC_GROUP eccgroup, tlsbuf &cookie)
+	{
+		if(hello_retry || tls_ver != 0x0304)
+			return "´íÎóµÄHelloRetryRequest";
+		// a HelloRetryRequest always rejects 0-RTT
+		if(early_offered)
+			early_status = early_rejected;
+		early_offered = false;
+		if(eccgroup != ECC_NONE)
+		{
+			// must be a group we support but did not already send a share for
+			if(eccgroup == share_group || crypto.get_ecc_index(eccgroup) < 0)
+				return "HelloRetryRequestÒªÇó²»Ö§³ÖµÄÍÖÔ²²ÎÊý";
+			share_group = eccgroup;
+		}
+		else if(cookie.size == 0)
+			return "HelloRetryRequestÃ»ÓÐ¸Ä±äÈÎºÎ²ÎÊý";
+
+		hello_retry_cookie.clear();
+		hello_retry_cookie.append(cookie.buf, cookie.size);
+		crypto.retry_hash(reader.buf, reader.buf_size);
+		hello_retry = true;
+		state_index = 0;
+		return send_client_hello(s, host.c_str(), version);
+	}
+
+	const char *on_encrypted_extensions(tlsbuf_reader &reader)
+	{
+		reader.readed += 3;
+		if(reader.readed + 2 > reader.buf_size)
+			return "´íÎóµÄEncryptedExtensions";
+		int  ext_end		= reader.readed + 2 + ntohs(reader.read<unsigned short>());
+		bool early_data_ok	= false;
+		while(reader.readed + 4 <= ext_end && ext_end <= reader.buf_size)
+		{
+			int type = ntohs(reader.read<unsigned short>());
+			int size = ntohs(reader.read<unsigned short>());
+			int next = reader.readed + size;
+			if(type == EXT_EARLY_DATA)
+				early_data_ok = true;
+			else if(type == EXT_RECORD_SIZE_LIMIT && size == 2)
+			{
+				const char *ret = set_record_limits(ntohs(reader.read<unsigned short>()), true);
+				if(ret)
+					return ret;
+			}
+			reader.readed = next;
+		}
+		if(early_data_ok)
+		{
+			if(!early_offered || !psk_accepted || crypto.get_chiper_type() != offered_ticket.cipher)
+				return "·þÎñÆ÷½ÓÊÜÁËÃ»ÓÐ·¢ËÍµÄearly data";
+			early_status = early_accepted;
 		}
+		else if(early_offered)
+			early_status = early_rejected;
 		return 0;
 	}
 
@@ -1208,10 +2476,13 @@ class tls_client
 		const char *ret;
 		if(ret = send_client_exchange(s))
 			return ret;
+		if(ret = crypto.tls12_master_secret(extended_master))
+			return ret;
 
 		if(ret = send_change_cipherspec(s))
 			return ret;
-		crypto.set_encoding(true);
+		// the server's records stay plaintext until its ChangeCipherSpec
+		crypto.set_write_encoding(true);
 		if(ret = send_client_finish(s))
 			return ret;
 		
@@ -1240,12 +2511,118 @@ class tls_client
 			const char *ret = send_change_cipherspec(s);
 			if(ret)
 				return ret;
+			if(early_status == early_accepted && (ret = send_end_of_early_data()))
+				return ret;
 			if(ret = send_client_finish(s))
 				return ret;
 			crypto.reset_sequence_number();
 			if(ret = crypto.tls13_compute_key(ECC_NONE, 0, 0, finished_hash))
 				return ret;
+			crypto.tls13_resumption_secret();
+		}
+		else
+		{
+			// abbreviated handshake: answer the server's Finished with ours
+			if(session_resumed)
+			{
+				const char *ret;
+				if(ret = send_change_cipherspec(s))
+					return ret;
+				crypto.set_write_encoding(true);
+				if(ret = send_client_finish(s))
+					return ret;
+			}
+			// open() already returned at ServerHelloDone in a full handshake,
+			// so this can be any later recv()
+			save_session12();
+		}
+		return 0;
+	}
+
+	// keep the TLS 1.2 session once the server's Finished checked out
+	void save_session12()
+	{
+		if(resumption == resume_none)
+			return;
+		if(new_session.session_id.empty() && new_session.ticket.empty())
+		{
+			drop_session12(session_key);
+			return;
+		}
+		new_session.cipher = crypto.get_chiper_type();
+		new_session.extended_master = extended_master;
+		memcpy(new_session.master_key, crypto.tls12_master_key(), sizeof(new_session.master_key));
+		// a resumed session keeps aging from its full handshake
+		if(!session_resumed)
+			new_session.received = GetTickCount();
+		if(new_session.lifetime == 0 || new_session.lifetime > 36000)
+			new_session.lifetime = 36000;	// ten hours, the Windows server cache default
+		put_session12(session_key, new_session);
+	}
+
+	// RFC 5077 3.3: lifetime hint and the opaque ticket
+	const char *on_tls12_session_ticket(tlsbuf_reader &reader)
+	{
+		reader.readed += 3;
+		if(reader.readed + 4 + 2 > reader.buf_size)
+			return "´íÎóµÄNewSessionTicket";
+		unsigned lifetime	= ntohl(reader.read<unsigned int>());
+		int ticket_len		= ntohs(reader.read<unsigned short>());
+		if(reader.readed + ticket_len > reader.buf_size)
+			return "´íÎóµÄNewSessionTicket";
+		new_session.ticket.assign(reader.buf + reader.readed, ticket_len);
+		new_session.lifetime = lifetime;
+		new_session.received = GetTickCount();
+		return 0;
+	}
+
+	// RFC 8446 4.6.1: keep the ticket for the next connection to this host:port
+	const char *on_new_session_ticket(tlsbuf_reader &reader)
+	{
+		if(resumption == resume_none)
+			return 0;
+		if(!is_tls13(crypto.get_chiper_type()))
+			return on_tls12_session_ticket(reader);
+		reader.readed += 3;
+		if(reader.readed + 4 + 4 + 1 > reader.buf_size)
+			return "´íÎóµÄNewSessionTicket";
+
+		tls_session_ticket ticket;
+		ticket.lifetime	= ntohl(reader.read<unsigned int>());
+		ticket.age_add	= ntohl(reader.read<unsigned int>());
+		int nonce_len	= reader.read<unsigned char>();
+		if(reader.readed + nonce_len + 2 > reader.buf_size)
+			return "´íÎóµÄNewSessionTicket";
+		const u8 *nonce	= (const u8*)reader.buf + reader.readed;
+		reader.readed	+= nonce_len;
+		int ticket_len	= ntohs(reader.read<unsigned short>());
+		if(ticket_len == 0 || reader.readed + ticket_len > reader.buf_size)
+			return "´íÎóµÄNewSessionTicket";
+		ticket.ticket.assign(reader.buf + reader.readed, ticket_len);
+		reader.readed += ticket_len;
+
+		ticket.max_early_data = 0;
+		if(reader.readed + 2 <= reader.buf_size)
+		{
+			int ext_end = reader.readed + 2 + ntohs(reader.read<unsigned short>());
+			while(reader.readed + 4 <= ext_end && ext_end <= reader.buf_size)
+			{
+				int type = ntohs(reader.read<unsigned short>());
+				int size = ntohs(reader.read<unsigned short>());
+				if(type == EXT_EARLY_DATA && size == 4)
+					ticket.max_early_data = ntohl(*(unsigned int*)(reader.buf + reader.readed));
+				reader.readed += size;
+			}
 		}
+
+		if(ticket.lifetime == 0)
+			return 0;
+		if(ticket.lifetime > 604800)	// seven days at most
+			ticket.lifetime = 604800;
+		ticket.cipher	= crypto.get_chiper_type();
+		ticket.psk_len	= crypto.tls13_ticket_psk(ticket.psk, nonce, nonce_len);
+		ticket.received	= GetTickCount();
+		put_session(session_key, ticket);
 		return 0;
 	}
 	
@@ -1253,11 +2630,14 @@ class tls_client
 	{
 		const char *ret = 0;
 		bool tls_13 = is_tls13(crypto.get_chiper_type());
-		if(packet_type != CONTENT_CHANGECIPHERSPEC && packet_type != CONTENT_ALERT )
+		// alerts too, once the server's records are protected
+		if(packet_type != CONTENT_CHANGECIPHERSPEC)
 		{
 			if(ret = crypto.decode(reader, packet_type, version, tls_13 )  )
 				return ret;
-			if(tls_13 && crypto.get_encoding() && reader.buf_size > 0)
+			if(recv_record_max > 0 && crypto.get_read_encoding() && reader.buf_size > recv_record_max)
+				return "¼ÇÂ¼³¬¹ýÁËrecord_size_limit";
+			if(tls_13 && crypto.get_read_encoding() && reader.buf_size > 0)
 			{
 				packet_type = reader.buf[reader.buf_size-1];
 				reader.buf_size--;
@@ -1270,12 +2650,27 @@ class tls_client
 			tlsbuf_reader reader_sig(reader.buf+reader.readed, seg_size);
 
 			const tlsstate *state_seq = get_states_seq(tls_13);
+			// a TLS 1.2 server that issues a ticket sends it right before its CCS
+			bool new_ticket = !tls_13 && packet_type == CONTENT_HANDSHAKE && reader_sig.buf[0] == MSG_NEW_SESSION_TICKET;
 			if(state_index < get_states_count(tls_13) && packet_type != CONTENT_ALERT)
 			{
-				if(state_seq[state_index].content_type != packet_type || state_seq[state_index].handshake_type != reader_sig.buf[0])
-					return "´íÎóµÄ×´Ì¬";
-				state_index++;
+				// the TLS 1.3 compatibility CCS is optional, and after a
+				// HelloRetryRequest it comes before the second ServerHello;
+				// so is the NewSessionTicket in the abbreviated TLS 1.2 handshake
+				bool ccs_expected = state_seq[state_index].content_type == CONTENT_CHANGECIPHERSPEC;
+				if(tls_13 && ccs_expected && packet_type != CONTENT_CHANGECIPHERSPEC)
+					state_index++;
+				if(!new_ticket && !(tls_13 && !ccs_expected && packet_type == CONTENT_CHANGECIPHERSPEC))
+				{
+					if(state_seq[state_index].content_type != packet_type || state_seq[state_index].handshake_type != reader_sig.buf[0])
+						return "´íÎóµÄ×´Ì¬";
+					state_index++;
+				}
 			}
+			// full TLS 1.2 handshake: open() is done at ServerHelloDone, but
+			// until the server's CCS only the NewSessionTicket may come
+			else if(!tls_13 && !crypto.get_read_encoding() && packet_type != CONTENT_ALERT && packet_type != CONTENT_CHANGECIPHERSPEC && !new_ticket)
+				return "´íÎóµÄ×´Ì¬";
 
 			DumpData("½ÓÊÕÊý¾Ý:", reader_sig.buf, reader_sig.buf_size);
 			if(packet_type == CONTENT_HANDSHAKE && reader_sig.buf_size > 0 && reader_sig.buf[0] != MSG_FINISHED)
@@ -1287,9 +2682,13 @@ class tls_client
 					ret = on_server_hello(reader_sig);
 				else if(handshake_type == MSG_CERTIFICATE)
 					ret = on_server_certificate(reader_sig);
+				else if(handshake_type == MSG_ENCRYPTED_EXTENSIONS)
+					ret = on_encrypted_extensions(reader_sig);
 				else if(handshake_type == MSG_CERTIFICATE_VERIFY)
 				{
 				}
+				else if(handshake_type == MSG_NEW_SESSION_TICKET)
+					ret = on_new_session_ticket(reader_sig);
 				else if(handshake_type == MSG_SERVER_KEY_EXCHANGE)
 					ret = on_server_key_exchange(reader_sig);
 				else if(handshake_type == MSG_SERVER_HELLO_DONE)
@@ -1313,6 +2712,13 @@ class tls_client
 			}
 			else if(packet_type == CONTENT_CHANGECIPHERSPEC)
 			{
+				// TLS 1.2: the server's Finished is its first protected record
+				if(!tls_13)
+				{
+					if(crypto.get_read_encoding())
+						return "´íÎóµÄ×´Ì¬";
+					crypto.set_read_encoding(true);
+				}
 			}
 			else if(packet_type == CONTENT_ALERT)
 			{
@@ -1336,9 +2742,13 @@ class tls_client
 				}
 			}
 			else if (packet_type == CONTENT_APPLICATION_DATA) {
-				printf("TLS: before append, recv channel size: %d\n",  recv_channel.size);
-				recv_channel.append(reader.buf, reader.buf_size);
-				printf("TLS: after append, recv channel size: %d\n",  recv_channel.size);
+				if(reader.buf_size > 0)
+				{
+					trace(trace_plaintext_in, reader.buf, reader.buf_size);
+					recv_span span = {(int)(reader.buf - recv_buf.buf), reader.buf_size};
+					recv_spans.push_back(span);
+					recv_pending += reader.buf_size;
+				}
 			}
 				
 			reader.readed += seg_size;
@@ -1352,47 +2762,73 @@ class tls_client
 			return 0;
 		try
 		{
-			recv_buf.check_size(recv_buf.size+4096*4);
+			compact_recv_buf();
+			recv_buf.check_size(4096*4);
 			int len = ::recv(s, recv_buf.buf+recv_buf.size, 4096*4, 0);
 			if(len <= 0)
 				throw "Á¬½Ó¶Ï¿ª";
 			recv_buf.size += len;
 
-			int cur_index = 0;
-			while(cur_index + 5 <= recv_buf.size)
+			while(recv_parsed + 5 <= recv_buf.size)
 			{
-				int packet_size = ntohs(*(unsigned short*)(recv_buf.buf+cur_index+3));
-				if(cur_index + 5 + packet_size > recv_buf.size)
+				int packet_size = ntohs(*(unsigned short*)(recv_buf.buf+recv_parsed+3));
+				if(recv_parsed + 5 + packet_size > recv_buf.size)
 					break;
+				trace(trace_record_in, recv_buf.buf+recv_parsed, 5+packet_size);
 				
-				const char *ret = on_packet(*(BYTE*)(recv_buf.buf+cur_index), *(WORD*)(recv_buf.buf+cur_index+1), tlsbuf_reader(recv_buf.buf+cur_index+5, packet_size));
+				const char *ret = on_packet(*(BYTE*)(recv_buf.buf+recv_parsed), *(WORD*)(recv_buf.buf+recv_parsed+1), tlsbuf_reader(recv_buf.buf+recv_parsed+5, packet_size));
 				if(ret)
 					throw ret;
 
-				cur_index += 5+packet_size;
+				recv_parsed += 5+packet_size;
 			}
-			memcpy(recv_buf.buf, recv_buf.buf+cur_index, recv_buf.size - cur_index);
-			recv_buf.size -= cur_index;
-			
 		}catch(const char *err){
 			close();
 			return err;
 		}
 		return 0;
 	}
+	// Drops read records from the front of recv_buf. Unread application
+	// data is only moved once most of the buffer in front of it is dead.
+	void compact_recv_buf()
+	{
+		int keep = recv_pending > 0 ? recv_spans[recv_span_index].offset : recv_parsed;
+		if(keep == 0 || (recv_pending > 0 && keep < recv_buf.size/2))
+			return;
+		memmove(recv_buf.buf, recv_buf.buf+keep, recv_buf.size - keep);
+		recv_buf.size	-= keep;
+		recv_parsed		-= keep;
+		recv_spans.erase(recv_spans.begin(), recv_spans.begin() + recv_span_index);
+		recv_span_index = 0;
+		for(size_t i = 0; i < recv_spans.size(); i++)
+			recv_spans[i].offset -= keep;
+	}
+	void consume_span(int size)
+	{
+		recv_span &span = recv_spans[recv_span_index];
+		span.offset		+= size;
+		span.size		-= size;
+		recv_pending	-= size;
+		if(span.size == 0)
+			recv_span_index++;
+		if(recv_pending == 0)
+		{
+			recv_spans.clear();
+			recv_span_index = 0;
+		}
+	}
 	int read_channel(char *out, int size)
 	{
-		int movesize = min(size, recv_channel.size-recv_channel_readed);
-		memcpy(out, recv_channel.buf+recv_channel_readed, movesize);
-		recv_channel_readed += movesize;
-
-		if(recv_channel_readed > recv_channel.size/4*3 && recv_channel.size > 1024*1024 || recv_channel_readed >= recv_channel.size)
+		int readed = 0;
+		while(readed < size && recv_pending > 0)
 		{
-			memcpy(recv_channel.buf, recv_channel.buf+recv_channel_readed, recv_channel.size - recv_channel_readed);
-			recv_channel.size -= recv_channel_readed;
-			recv_channel_readed = 0;
+			const recv_span &span = recv_spans[recv_span_index];
+			int movesize = min(size - readed, span.size);
+			memcpy(out + readed, recv_buf.buf + span.offset, movesize);
+			readed += movesize;
+			consume_span(movesize);
 		}
-		return movesize;
+		return readed;
 	}
 	int socket_signal(int wait_sec)
 	{
@@ -1417,10 +2853,13 @@ class tls_client
 public:
 	tls_client()
 	{
+		memset(&send_stats, 0, sizeof(send_stats));
 	}
 	~tls_client()
 	{
 		close();
+		if(nagle_queue)
+			DeleteTimerQueueEx(nagle_queue, INVALID_HANDLE_VALUE);	// waits for a running nagle_proc
 	}
 
 	void shutdown_send() {
@@ -1428,6 +2867,132 @@ public:
 			shutdown(s, SD_SEND);
 	}
 
+	// Key share group each host chose last time, so the next ClientHello
+	// offers the right single share and avoids a HelloRetryRequest.
+	struct group_cache
+	{
+		CLockData						lockdata;
+		std::map<std::string, ECC_GROUP>	groups;
+	};
+	static group_cache &get_group_cache()
+	{
+		static group_cache cache;
+		return cache;
+	}
+	static ECC_GROUP get_cached_group(const std::string &host)
+	{
+		group_cache &cache = get_group_cache();
+		CLock lock(cache.lockdata);
+		std::map<std::string, ECC_GROUP>::iterator it = cache.groups.find(host);
+		return it == cache.groups.end() ? ECC_NONE : it->second;
+	}
+	static void set_cached_group(const std::string &host, ECC_GROUP group)
+	{
+		group_cache &cache = get_group_cache();
+		CLock lock(cache.lockdata);
+		cache.groups[host] = group;
+	}
+
+	// TLS 1.3 tickets per host:port. Servers expect each to be used once,
+	// so take_session() removes the one it returns.
+	struct session_cache
+	{
+		CLockData													lockdata;
+		std::map<std::string, std::vector<tls_session_ticket> >	sessions;
+	};
+	static const int max_tickets = 4;	// per host:port
+	static session_cache &get_session_cache()
+	{
+		static session_cache cache;
+		return cache;
+	}
+	static bool take_session(const std::string &key, tls_session_ticket &out)
+	{
+		session_cache &cache = get_session_cache();
+		CLock lock(cache.lockdata);
+		std::map<std::string, std::vector<tls_session_ticket> >::iterator it = cache.sessions.find(key);
+		if(it == cache.sessions.end())
+			return false;
+		std::vector<tls_session_ticket> &tickets = it->second;
+		while(tickets.size() > 0)
+		{
+			out = tickets.back();
+			tickets.pop_back();
+			if(GetTickCount() - out.received < out.lifetime * 1000)
+				return true;
+		}
+		return false;
+	}
+	static void put_session(const std::string &key, const tls_session_ticket &ticket)
+	{
+		session_cache &cache = get_session_cache();
+		CLock lock(cache.lockdata);
+		std::vector<tls_session_ticket> &tickets = cache.sessions[key];
+		if((int)tickets.size() >= max_tickets)
+			tickets.erase(tickets.begin());
+		tickets.push_back(ticket);
+	}
+
+	// TLS 1.2 sessions, one per host:port; unlike TLS 1.3 tickets they
+	// can be resumed again and again until they expire
+	struct session12_cache
+	{
+		CLockData								lockdata;
+		std::map<std::string, tls12_session>	sessions;
+	};
+	static session12_cache &get_session12_cache()
+	{
+		static session12_cache cache;
+		return cache;
+	}
+	static bool get_session12(const std::string &key, tls12_session &out)
+	{
+		session12_cache &cache = get_session12_cache();
+		CLock lock(cache.lockdata);
+		std::map<std::string, tls12_session>::iterator it = cache.sessions.find(key);
+		if(it == cache.sessions.end())
+			return false;
+		if(GetTickCount() - it->second.received >= it->second.lifetime * 1000)
+		{
+			cache.sessions.erase(it);
+			return false;
+		}
+		out = it->second;
+		return true;
+	}
+	static void put_session12(const std::string &key, const tls12_session &session)
+	{
+		session12_cache &cache = get_session12_cache();
+		CLock lock(cache.lockdata);
+		cache.sessions[key] = session;
+	}
+	static void drop_session12(const std::string &key)
+	{
+		session12_cache &cache = get_session12_cache();
+		CLock lock(cache.lockdata);
+		cache.sessions.erase(key);
+	}
+
+	// Keep `depth` ephemeral keys per group ready on a low-priority thread
+	// so that open() does not wait for key generation; 0 stops the pool.
+	static void set_key_pool(int depth)
+	{
+		init_global();
+		tls_key_pool &pool = tls_key_pool::get();
+		if(depth <= 0)
+		{
+			pool.stop();
+			return;
+		}
+		for(int i = 0; i < tls_cipher::ecc_count; i++)
+			pool.add_group(tls_cipher::ecc_list()[i].iana, tls_cipher::ecc_list()[i].size);
+		pool.start(depth);
+	}
+	static tls_key_pool_stats get_key_pool_stats()
+	{
+		return tls_key_pool::get().stats();
+	}
+
 	static void init_global()
 	{
 		static CLockData lockdata;
@@ -1436,18 +3001,48 @@ public:
 		if(inited)
 			return;
 		aes_init_keygen_tables();
+		ecc_precompute(secp256r1);
+		ecc_precompute(secp384r1);
 		inited = true;
 	}
 
 	void close()
 	{
+		CLock lock(send_lock);
+		// corked or Nagle-held writes still go out, under the current keys
+		if(s != INVALID_SOCKET && open_record >= 0 && state_index >= get_states_count())
+			flush_pending();
 		received_close_notify = false;
 		state_index	= 0;
+		hello_retry	= false;
+		share_group	= ECC_NONE;
+		hello_retry_cookie.clear();
+		psk_offered	= false;
+		psk_accepted= false;
+		early_offered = false;
+		early_status  = early_none;
+		session_offered = false;
+		session_resumed = false;
+		extended_master = false;
+		recv_record_max	= 0;
+		send_record_limit = 0;
+		records_sent	= 0;
+		last_send_us	= 0;
+		new_session.session_id.clear();
+		new_session.ticket.clear();
+		new_session.lifetime = 0;
 		recv_buf.clear();
-		recv_channel.clear();
-		recv_channel_readed = 0;
+		recv_parsed		= 0;
+		recv_spans.clear();
+		recv_span_index	= 0;
+		recv_pending	= 0;
 		crypto.reset();
 		time_out		= 0x7fffffff;
+		open_record		= -1;
+		open_used		= 0;
+		corked			= false;
+		nagle_deadline	= 0;
+		send_out.clear();
 		if(s != INVALID_SOCKET)
 		{
 			shutdown(s, SD_BOTH);
@@ -1489,6 +3084,13 @@ public:
 		{
 			if(connect(s, (sockaddr*)&addr, sizeof(addr)) != 0)
 				throw "Á´½Ó·þÎñÆ÷Ê§°Ü";
+			char port_str[16];
+			sprintf(port_str, ":%d", port);
+			this->host		= host;
+			this->version	= version;
+			session_key		= this->host + port_str;
+			if(early_data.size > 0)
+				early_status = early_rejected;	// until the server says otherwise
 			if((ret = send_client_hello(s, host, version)))
 				throw ret;
 
@@ -1498,9 +3100,11 @@ public:
 					throw ret;
 			}
 		}catch(const char *err){
+			early_data.clear();
 			close();
 			return set_err(err, -1);
 		}
+		early_data.clear();
 
 		return 0;
 	}
@@ -1509,31 +3113,134 @@ public:
 
 	int send(char *buf, int size)
 	{
+		tls_iovec iov = {buf, size};
+		return sendv(&iov, 1);
+	}
+
+	// Sends the buffers as one stream. Records are filled straight from
+	// them into send_out, encrypted there and written with one ::send()
+	// per send_out_flush bytes. When corked or in Nagle mode the last
+	// record stays open so that the next writes fill it up.
+	int sendv(const tls_iovec *iov, int count)
+	{
+		CLock lock(send_lock);
 		if(state_index < get_states_count())
 			return 0;
-		send_buf.clear();
+		int size = 0;
+		for(int i = 0; i < count; i++)
+			size += iov[i].size;
+
+		if(record_sizing == record_dynamic)
+		{
+			int64_t now = now_us();
+			if(last_send_us != 0 && now - last_send_us > record_idle_us)
+				records_sent = 0;		// the congestion window has likely shrunk again
+			last_send_us = now;
+		}
+		int max_fragment = record_fragment_size();
+		send_stats.writes += (size + max_fragment - 1) / max_fragment;
+		int v = 0, v_off = 0;
 		for(int i = 0; i < size;)
 		{
-			int send_size = min(size-i, 60000);
-			send_buf.set_size(size);
-			memcpy(send_buf.buf, buf+i, send_size);
-			// After: memcpy(send_buf.buf, buf+i, send_size);
-			std::ofstream plaintext_log("tls_plaintext.log", std::ios::app | std::ios::binary);
-			plaintext_log.write(send_buf.buf, send_buf.size);
-			plaintext_log.close();
-			const char *ret = send_packet(CONTENT_APPLICATION_DATA, 0x303, send_buf);
+			if(open_record < 0)
+			{
+				open_capacity = record_fragment_size();
+				begin_record(CONTENT_APPLICATION_DATA, open_capacity, open_record);
+			}
+			char *plaintext = record_plaintext(CONTENT_APPLICATION_DATA, open_record);
+			int send_size = min(size-i, open_capacity - open_used);
+			for(int copied = 0; copied < send_size;)
+			{
+				int n = min(send_size - copied, iov[v].size - v_off);
+				memcpy(plaintext + open_used + copied, iov[v].buf + v_off, n);
+				copied	+= n;
+				v_off	+= n;
+				if(v_off == iov[v].size)
+				{
+					v++;
+					v_off = 0;
+				}
+			}
+			open_used += send_size;
+			if(open_used == open_capacity)
+				close_open_record();
+
+			const char *ret = send_out.size >= send_out_flush ? flush_send_out() : 0;
 			if(ret)
 				return set_err(ret, 0);
 
 			i += send_size;
 		}
+
+		const char *ret = 0;
+		if(!corked && nagle_us > 0 && open_record >= 0)
+		{
+			int64_t now = now_us();
+			if(nagle_deadline == 0)
+			{
+				nagle_deadline = now + nagle_us;
+				arm_nagle_timer();
+			}
+			if(now >= nagle_deadline)
+				ret = flush_pending();
+			else
+				ret = flush_send_out();		// full records need not wait
+		}
+		else if(!corked)
+			ret = flush_pending();
+		if(ret)
+			return set_err(ret, 0);
 		return size;
 	}
 
+	// Until uncork(), writes are only packed into full-size records; each
+	// record goes out as soon as it is full, the last one on uncork()
+	void cork()
+	{
+		CLock lock(send_lock);
+		corked = true;
+	}
+	int uncork()
+	{
+		CLock lock(send_lock);
+		corked = false;
+		return flush();
+	}
+	// Nagle-like batching without cork(): a partly filled record waits up to
+	// delay_us for more writes, then a timer sends it from a pool thread.
+	// recv(), flush() and a sendv() past the deadline send it sooner.
+	// 0 (the default) turns it off
+	void set_nagle(int delay_us)
+	{
+		CLock lock(send_lock);
+		nagle_us = max(delay_us, 0);
+	}
+	// sends whatever is held back; 0, or -1 with errmsg()
+	int flush()
+	{
+		CLock lock(send_lock);
+		if(s == INVALID_SOCKET)
+			return 0;
+		const char *ret = flush_pending();
+		if(ret)
+			return set_err(ret, -1);
+		return 0;
+	}
+	tls_send_stats get_send_stats()
+	{
+		CLock lock(send_lock);
+		tls_send_stats st = send_stats;
+		st.records_saved	= st.writes > st.records ? st.writes - st.records : 0;
+		st.bytes_saved		= st.records_saved * record_overhead;
+		return st;
+	}
 
-	int recv(char *out, int size)
+
+	// Waits for application data as recv() does; 1 when there is some to
+	// read, otherwise what recv() returns
+	int fill_channel()
 	{
-		if (received_close_notify && recv_channel.size <= recv_channel_readed) {
+		if (received_close_notify && recv_pending <= 0) {
 			close();
 			return 0;
 		}
@@ -1541,16 +3248,23 @@ public:
 		DWORD dw = GetTickCount();
 		if(state_index < get_states_count())
 			return set_err("socket Î´³õÊ¼»¯", 0);
+		// a reply will not come while the request is still held back
+		{
+			CLock lock(send_lock);
+			const char *ret = open_record >= 0 && !corked ? flush_pending() : 0;
+			if(ret)
+				return set_err(ret, 0);
+		}
 		while(1)
 		{
 			if (received_close_notify) {
 				break;
 			}
 
-			int signal = socket_signal(recv_channel.size <= recv_channel_readed ? 1 : 0);
+			int signal = socket_signal(recv_pending <= 0 ? 1 : 0);
 			if(signal == -1)
 				return set_err("socket select´íÎó", 0);
-			if(!signal && recv_channel.size > recv_channel_readed)
+			if(!signal && recv_pending > 0)
 				break;
 
 			if(signal == 0)
@@ -1563,9 +3277,34 @@ public:
 			if(ret)
 				return set_err(ret, 0);
 		}
+		return 1;
+	}
+
+	int recv(char *out, int size)
+	{
+		int ret = fill_channel();
+		if(ret <= 0)
+			return ret;
 		return read_channel(out, size);
 	}
 
+	// Zero-copy recv(): points *data at the next piece of decrypted
+	// application data inside the receive buffer instead of copying it.
+	// The bytes count as read and stay valid until the next recv() or
+	// recv_view() call.
+	int recv_view(const char **data)
+	{
+		*data = 0;
+		int ret = fill_channel();
+		if(ret <= 0 || recv_pending <= 0)
+			return ret <= 0 ? ret : 0;
+		const recv_span &span = recv_spans[recv_span_index];
+		int size = span.size;
+		*data = recv_buf.buf + span.offset;
+		consume_span(size);
+		return size;
+	}
+
 	const char *errmsg()
 	{
 		return err_msg.buf;
@@ -1580,4 +3319,159 @@ public:
 	{
 		time_out = v;
 	}
+
+	// GHASH strategy for aes-gcm (GCM_GHASH_*), applied from the next open().
+	// GCM_GHASH_TABLE4 saves ~128 KB per connection when there is no PCLMULQDQ
+	void set_ghash_mode(int mode)
+	{
+		crypto.set_ghash_mode(mode);
+	}
+
+	// TLS 1.3 resumption mode (resume_*), applied from the next open()
+	void set_resumption(tls_resumption mode)
+	{
+		resumption = mode;
+	}
+	// true when the last handshake resumed a session: a TLS 1.3 PSK or a
+	// TLS 1.2 session ID / ticket
+	bool resumed()
+	{
+		return psk_accepted || session_resumed;
+	}
+
+	// record_size_limit (RFC 8449) asked from the server, 64..16385, applied
+	// from the next open(); small records let the first bytes decrypt sooner.
+	// 16385 only exists in TLS 1.3: a TLS 1.2 handshake offers and enforces
+	// at most 16384. 0 (the default) does not send the extension
+	void set_record_size_limit(int limit)
+	{
+		recv_record_limit = limit <= 0 ? 0 : max(64, min(limit, 16385));
+	}
+	// the server's record_size_limit as plaintext bytes per record we send,
+	// 0 when it did not negotiate one
+	int record_size_limit()
+	{
+		return send_record_limit;
+	}
+
+	// Size of the application records send() builds: at most max_size
+	// plaintext bytes (64..16384, and never more than the server's
+	// record_size_limit). record_dynamic (the default) starts each busy
+	// period with records of one TCP segment so the peer can decrypt the
+	// first bytes sooner; record_fixed always fills records to max_size.
+	void set_record_sizing(tls_record_sizing mode, int max_size = record_max_size)
+	{
+		record_sizing	= mode;
+		record_size		= max(64, min(max_size, record_max_size));
+	}
+
+	// Hands every record and its plaintext to fn(ctx, ...) on the calling
+	// thread, e.g. to write a capture file. The data are only valid during
+	// the call and the plaintext events carry secrets. fn == 0 (the
+	// default) turns tracing off.
+	void set_trace(tls_trace_fn fn, void *ctx)
+	{
+		trace_fn	= fn;
+		trace_ctx	= ctx;
+	}
+
+	// Bytes to send as TLS 1.3 early data (0-RTT) in the first flight of
+	// the next open(), if a cached ticket allows it. Early data can be
+	// replayed by an attacker, so only pass idempotent requests. After
+	// open(), early_data_status() == early_rejected means send() them again.
+	void set_early_data(const char *buf, int size)
+	{
+		early_data.clear();
+		if(buf && size > 0)
+			early_data.append(buf, size);
+	}
+	tls_early_data early_data_status()
+	{
+		return early_status;
+	}
+
+#ifdef TLS13_SELFTEST
+	// RFC 8449 at the TLS 1.2 boundary: 16385 is offered as 16384 unless
+	// TLS 1.3 is offered too, the negotiated limits follow the version, and
+	// a TLS 1.2 record of exactly 16384 bytes passes while 16385 is refused.
+	// "mytls --selftest" runs it after tls_cipher::tls13_selftest()
+	static const char *record_limit_selftest()
+	{
+		tls_client	client;
+		tls_cipher	server;
+		client.set_record_size_limit(16385);
+		if(client.record_limit_for(false) != 16384 || client.record_limit_for(true) != 16385)
+			return "record_size_limit offered";
+		if(client.set_record_limits(16385, true) || client.record_size_limit() != 16384 || client.recv_record_max != 16385)
+			return "record_size_limit TLS 1.3";
+		if(client.set_record_limits(16385, false) || client.record_size_limit() != 16384 || client.recv_record_max != 16384)
+			return "record_size_limit TLS 1.2";
+
+		tls_cipher::selftest_pair(client.crypto, server, TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256, false);
+		client.state_index = client.get_states_count();
+		tlsbuf data;
+		data.set_size(16385);
+		memset(data.buf, 'x', data.size);
+		for(int size = 16384; size <= 16385; size++)
+			if((selftest_record(client, server, CONTENT_APPLICATION_DATA, data.buf, size) != 0) != (size > 16384))
+				return "record_size_limit TLS 1.2 record";
+		return 0;
+	}
+
+	// A full TLS 1.2 handshake with a server that issues tickets, from our
+	// Finished on: the plaintext NewSessionTicket, the server's CCS and its
+	// protected Finished, after which the ticket is cached. Plaintext
+	// application data before the CCS and a second CCS are refused.
+	static const char *tls12_ticket_selftest()
+	{
+		tls_client	client;
+		tls_cipher	server;
+		tls_cipher::selftest_pair(client.crypto, server, TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256, false);
+		client.crypto.set_read_encoding(false);	// as on_server_hello_done() leaves it
+		server.set_encoding(false);
+		client.state_index = client.get_states_count();
+		client.session_key = "tls12-ticket-selftest:443";
+
+		static const char ticket[] = {MSG_NEW_SESSION_TICKET, 0, 0, 12, 0, 0, 0x1c, 0x20, 0, 6, 't', 'i', 'c', 'k', 'e', 't'};
+		static const char ccs[] = {1};
+		if(selftest_record(client, server, CONTENT_APPLICATION_DATA, "GET", 3) == 0)
+			return "TLS 1.2 plaintext data";
+		if(selftest_record(client, server, CONTENT_HANDSHAKE, ticket, sizeof(ticket)) || client.new_session.ticket != "ticket")
+			return "TLS 1.2 NewSessionTicket";
+		server.update_hash(ticket, sizeof(ticket));
+		if(selftest_record(client, server, CONTENT_CHANGECIPHERSPEC, ccs, sizeof(ccs)) || !client.crypto.get_read_encoding())
+			return "TLS 1.2 server CCS";
+
+		tlsbuf verify, finished;
+		server.compute_verify(verify, 1, 12, false, 1);
+		finished.append((char)MSG_FINISHED);
+		finished.append((char)0);
+		finished.append(htons(verify.size));
+		finished.append(verify.buf, verify.size);
+		server.set_write_encoding(true);
+		tls12_session saved;
+		if(selftest_record(client, server, CONTENT_HANDSHAKE, finished.buf, finished.size) || !get_session12(client.session_key, saved) || saved.ticket != "ticket")
+			return "TLS 1.2 server Finished";
+		drop_session12(client.session_key);
+		if(selftest_record(client, server, CONTENT_CHANGECIPHERSPEC, ccs, sizeof(ccs)) == 0)
+			return "TLS 1.2 second CCS";
+		return 0;
+	}
+
+	// one TLS 1.2 record from the server side, protected once server seals
+	static const char *selftest_record(tls_client &client, tls_cipher &server, int type, const char *data, int size)
+	{
+		tlsbuf	record;
+		int		body = server.record_body_size(size, false);
+		record.set_size(5 + body);
+		record.buf[0] = (char)type;
+		record.buf[1] = 3;
+		record.buf[2] = 3;
+		*(u_short*)(record.buf + 3) = htons(body);
+		memcpy(record.buf + 5 + server.plaintext_offset(false), data, size);
+		server.encode(record.buf, size, false);
+		tlsbuf_reader reader(record.buf + 5, body);
+		return client.on_packet(type, *(WORD*)(record.buf + 1), reader);
+	}
+#endif
 };
@@ -120,6 +120,22 @@ std::vector<Quality> parse_m3u8(const std::string& text) {
 }
 
 int main(int argc, char** argv) {
+#ifdef TLS13_SELFTEST
+    // Debug builds run "mytls --selftest" after linking, see mytls.vcxproj
+    if (argc == 2 && std::string(argv[1]) == "--selftest") {
+        const char* failed = tls_cipher::tls13_selftest();
+        if (!failed)
+            failed = tls_client::record_limit_selftest();
+        if (!failed)
+            failed = tls_client::tls12_ticket_selftest();
+        if (failed) {
+            std::cerr << "[SELFTEST] failed: " << failed << "\n";
+            return 1;
+        }
+        std::cout << "[SELFTEST] ok\n";
+        return 0;
+    }
+#endif
     std::cout << "[DEBUG] Program started\n";
     if (argc != 2) {
         std::cout << "Usage: mytls <twitch_channel>\n";